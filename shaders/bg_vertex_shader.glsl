@@ -4,9 +4,12 @@
 layout(location = 0) in vec2 vertexPosition;
 layout(location = 1) in vec2 texturePosition;
 
+// 1 puts the quad on the far plane, so with GL_LEQUAL it only fills pixels nothing was drawn to (earlyZ=1)
+uniform float backgroundDepth;
+
 out vec2 textureCoord;
 
 void main() {
-    gl_Position = vec4(vertexPosition, 0.0f, 1.0f);
+    gl_Position = vec4(vertexPosition, backgroundDepth, 1.0f);
     textureCoord = texturePosition;
 }
@@ -1,21 +1,35 @@
-
 #version 330
 
-uniform sampler2D textureSampler;
+// Specialized variants get DISABLE_TRANSPARENT and UPSCALE_RGBA (0 or 1) defined right after the version line, see
+// GetModelPipeline(). Without them the uniform and the per-instance flag decide for every fragment.
+#ifdef DISABLE_TRANSPARENT
+#define TRANSPARENT_DISABLED (DISABLE_TRANSPARENT != 0)
+#else
 uniform int disableTransparent;
-uniform int upscaleRGBA;
+#define TRANSPARENT_DISABLED (disableTransparent != 0)
+#endif
+
+#ifdef UPSCALE_RGBA
+#define UPSCALED (UPSCALE_RGBA != 0)
+#else
+#define UPSCALED (upscaleRGBA != 0)
+#endif
+
+uniform sampler2DArray textureSampler;
 
 in vec2 textureCoord;
+flat in float skinLayer;
+flat in int upscaleRGBA;
 
 out vec4 outColor;
 
 void main() {
-    outColor = texture(textureSampler, textureCoord);
-    if (disableTransparent == 0 && outColor.a != 1.0f) {
+    outColor = texture(textureSampler, vec3(textureCoord, skinLayer));
+    if (!TRANSPARENT_DISABLED && outColor.a != 1.0f) {
         discard;
-    } else if (upscaleRGBA != 0 && disableTransparent == 0 && outColor == vec4(0.0f, 0.0f, 0.0f, 1.0f)) {
+    } else if (UPSCALED && !TRANSPARENT_DISABLED && outColor == vec4(0.0f, 0.0f, 0.0f, 1.0f)) {
         discard;
-    } else if (disableTransparent != 0 && outColor.a != 1.0f) {
+    } else if (TRANSPARENT_DISABLED && outColor.a != 1.0f) {
         outColor = vec4(0.0f, 0.0f, 0.0f, 1.0f);
     }
 }
@@ -1,15 +1,31 @@
 
 #version 330
 
+// Packed vertices carry model space positions in half units, texel coordinates and a part index; the part matrix
+// moves them into place. Float vertices use a single identity part and a texture scale of 1.
 layout(location = 0) in vec4 vertexPosition;
 layout(location = 1) in vec2 texturePosition;
+layout(location = 2) in uint partIndex;
 
-uniform mat4 viewMatrix;
-uniform mat4 projectMatrix;
+// per instance: placement in the scene, skin layer and upscaleRGBA flag
+layout(location = 3) in mat4 instanceMatrix;
+layout(location = 7) in vec2 instanceSkin;
+
+// one block per view, bound with glBindBufferRange
+layout(std140) uniform Camera {
+    mat4 viewMatrix;
+    mat4 projectMatrix;
+};
+uniform mat4 partMatrices[16];
+uniform float textureScale;
 
 out vec2 textureCoord;
+flat out float skinLayer;
+flat out int upscaleRGBA;
 
 void main() {
-    gl_Position = projectMatrix * viewMatrix * vertexPosition;
-    textureCoord = texturePosition;
+    gl_Position = projectMatrix * viewMatrix * instanceMatrix * partMatrices[partIndex] * vertexPosition;
+    textureCoord = texturePosition * textureScale;
+    skinLayer = instanceSkin.x;
+    upscaleRGBA = int(instanceSkin.y);
 }
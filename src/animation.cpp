@@ -0,0 +1,389 @@
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Animated output for animate=turntable. Frames arrive one at a time. APNG frames are encoded as they come, every frame
+// after the first cropped to the rectangle that changed since the previous one. GIF needs a single palette shared by
+// all frames, so its frames are kept until the last one has arrived.
+
+// Eye position rotated around the up axis through the target.
+ModelCamera GetTurntableCamera(const ModelCamera &camera, float angle) {
+    glm::mat4 rotation = glm::rotate(glm::mat4(1.0f), angle, camera.eyeUpDirection);
+    ModelCamera ret = camera;
+    ret.eyePosition = camera.eyeTarget + glm::vec3(rotation * glm::vec4(camera.eyePosition - camera.eyeTarget, 0.0f));
+    return ret;
+}
+
+struct FrameRect {
+    unsigned int x, y, width, height;
+};
+
+struct AnimationWriter {
+    std::FILE *output;
+    bool gif;
+    unsigned int width, height, bytePerPixel;
+    unsigned int frameCount;
+    unsigned int frameDelay;  // milliseconds
+    unsigned int framesAdded;
+    unsigned int sequenceNumber;                     // APNG fcTL/fdAT numbering
+    std::vector<unsigned char> previous;             // APNG: last frame, top-down rows
+    std::vector<std::vector<unsigned char>> frames;  // GIF: top-down frames waiting for the palette
+};
+
+// Bounding box of the pixels that differ between two top-down frames, a single pixel when nothing changed.
+FrameRect GetDirtyRect(const unsigned char *previous, const unsigned char *current, unsigned int width,
+                       unsigned int height, unsigned int bytePerPixel) {
+    size_t stride = static_cast<size_t>(width) * bytePerPixel;
+    unsigned int top = 0, bottom = height;
+    while (top < height && std::memcmp(previous + top * stride, current + top * stride, stride) == 0) ++top;
+    if (top == height) return FrameRect{0, 0, 1, 1};
+    while (std::memcmp(previous + (bottom - 1) * stride, current + (bottom - 1) * stride, stride) == 0) --bottom;
+    unsigned int left = width, right = 0;
+    for (unsigned int Y = top; Y < bottom; ++Y) {
+        const unsigned char *previousRow = previous + Y * stride, *currentRow = current + Y * stride;
+        unsigned int X = 0;
+        while (X < left &&
+               std::memcmp(previousRow + X * bytePerPixel, currentRow + X * bytePerPixel, bytePerPixel) == 0)
+            ++X;
+        left = std::min(left, X);
+        X = width;
+        while (X > right && std::memcmp(previousRow + (X - 1) * bytePerPixel, currentRow + (X - 1) * bytePerPixel,
+                                        bytePerPixel) == 0)
+            --X;
+        right = std::max(right, X);
+    }
+    return FrameRect{left, top, right - left, bottom - top};
+}
+
+inline void AppendUInt32BE(std::vector<unsigned char> &buffer, unsigned int value) {
+    buffer.push_back(static_cast<unsigned char>(value >> 24));
+    buffer.push_back(static_cast<unsigned char>(value >> 16));
+    buffer.push_back(static_cast<unsigned char>(value >> 8));
+    buffer.push_back(static_cast<unsigned char>(value));
+}
+
+inline void AppendUInt16BE(std::vector<unsigned char> &buffer, unsigned int value) {
+    buffer.push_back(static_cast<unsigned char>(value >> 8));
+    buffer.push_back(static_cast<unsigned char>(value));
+}
+
+inline void AppendUInt16LE(std::vector<unsigned char> &buffer, unsigned int value) {
+    buffer.push_back(static_cast<unsigned char>(value));
+    buffer.push_back(static_cast<unsigned char>(value >> 8));
+}
+
+void WritePNGChunk(std::FILE *output, const char *type, const std::vector<unsigned char> &data) {
+    std::vector<unsigned char> header;
+    AppendUInt32BE(header, data.size());
+    header.insert(header.end(), type, type + 4);
+    unsigned long crc = crc32(0, reinterpret_cast<const Bytef *>(type), 4);
+    // a null buffer would make crc32() return its initial value instead
+    if (!data.empty()) crc = crc32(crc, data.data(), data.size());
+    std::vector<unsigned char> trailer;
+    AppendUInt32BE(trailer, crc);
+    std::fwrite(header.data(), 1, header.size(), output);
+    std::fwrite(data.data(), 1, data.size(), output);
+    std::fwrite(trailer.data(), 1, trailer.size(), output);
+}
+
+inline unsigned char PaethPredictor(int left, int up, int upLeft) {
+    int estimate = left + up - upLeft;
+    int distanceLeft = std::abs(estimate - left), distanceUp = std::abs(estimate - up),
+        distanceUpLeft = std::abs(estimate - upLeft);
+    if (distanceLeft <= distanceUp && distanceLeft <= distanceUpLeft) return left;
+    return distanceUp <= distanceUpLeft ? up : upLeft;
+}
+
+// Filtered and deflated rows of a sub-rectangle. Every row takes the filter with the smallest sum of absolute
+// residuals, the heuristic libpng uses as well.
+std::vector<unsigned char> CompressPNGRect(const unsigned char *frame, unsigned int frameWidth,
+                                           unsigned int bytePerPixel, const FrameRect &rect) {
+    size_t stride = static_cast<size_t>(frameWidth) * bytePerPixel;
+    size_t length = static_cast<size_t>(rect.width) * bytePerPixel;
+    std::vector<unsigned char> filtered;
+    filtered.reserve((length + 1) * rect.height);
+    std::vector<unsigned char> zeroRow(length, 0), candidate(length);
+    std::vector<unsigned char> best(length);
+    for (unsigned int Y = 0; Y < rect.height; ++Y) {
+        const unsigned char *row = frame + (rect.y + Y) * stride + rect.x * bytePerPixel;
+        const unsigned char *prior = Y == 0 ? zeroRow.data() : row - stride;
+        unsigned long long bestCost = ~0ull;
+        unsigned char bestFilter = 0;
+        for (unsigned char filter = 0; filter < 5; ++filter) {
+            unsigned long long cost = 0;
+            for (size_t index = 0; index < length; ++index) {
+                int left = index >= bytePerPixel ? row[index - bytePerPixel] : 0;
+                int upLeft = index >= bytePerPixel ? prior[index - bytePerPixel] : 0;
+                int predicted = filter == 1   ? left
+                                : filter == 2 ? prior[index]
+                                : filter == 3 ? (left + prior[index]) / 2
+                                : filter == 4 ? PaethPredictor(left, prior[index], upLeft)
+                                              : 0;
+                candidate[index] = static_cast<unsigned char>(row[index] - predicted);
+                cost += std::abs(static_cast<signed char>(candidate[index]));
+            }
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestFilter = filter;
+                best.swap(candidate);
+            }
+        }
+        filtered.push_back(bestFilter);
+        filtered.insert(filtered.end(), best.begin(), best.end());
+    }
+    uLongf compressedSize = compressBound(filtered.size());
+    std::vector<unsigned char> compressed(compressedSize);
+    compress2(compressed.data(), &compressedSize, filtered.data(), filtered.size(), Z_DEFAULT_COMPRESSION);
+    compressed.resize(compressedSize);
+    return compressed;
+}
+
+// A frame replaces its rectangle (blend op source) and stays on the canvas for the next frame (dispose op none), so
+// pixels outside the dirty rectangle never have to be sent again.
+void WriteAPNGFrame(AnimationWriter &writer, const unsigned char *frame, const FrameRect &rect) {
+    std::vector<unsigned char> control;
+    AppendUInt32BE(control, writer.sequenceNumber++);
+    AppendUInt32BE(control, rect.width);
+    AppendUInt32BE(control, rect.height);
+    AppendUInt32BE(control, rect.x);
+    AppendUInt32BE(control, rect.y);
+    AppendUInt16BE(control, writer.frameDelay);
+    AppendUInt16BE(control, 1000);
+    control.push_back(0);  // APNG_DISPOSE_OP_NONE
+    control.push_back(0);  // APNG_BLEND_OP_SOURCE
+    WritePNGChunk(writer.output, "fcTL", control);
+    std::vector<unsigned char> compressed = CompressPNGRect(frame, writer.width, writer.bytePerPixel, rect);
+    if (writer.framesAdded == 0) {
+        WritePNGChunk(writer.output, "IDAT", compressed);
+        return;
+    }
+    std::vector<unsigned char> data;
+    data.reserve(compressed.size() + 4);
+    AppendUInt32BE(data, writer.sequenceNumber++);
+    data.insert(data.end(), compressed.begin(), compressed.end());
+    WritePNGChunk(writer.output, "fdAT", data);
+}
+
+// Variable length LZW as GIF specifies it: codes are packed LSB first, grow up to 12 bits and the table starts over
+// with a clear code once 4095 is handed out. Output is split into sub-blocks of at most 255 bytes.
+void WriteGIFImageData(std::FILE *output, const std::vector<unsigned char> &indices, unsigned int minCodeSize) {
+    const unsigned int clearCode = 1u << minCodeSize, endCode = clearCode + 1, maxCode = 4095;
+    const unsigned int tableSize = 8192;  // power of two, (prefix, index) pairs -> code
+    std::vector<unsigned int> tableKeys(tableSize);
+    std::vector<int> tableCodes(tableSize, -1);
+    std::vector<unsigned char> bytes;
+    unsigned int bitBuffer = 0, bitCount = 0, codeSize = minCodeSize + 1, nextCode = endCode + 1;
+    auto writeCode = [&](unsigned int code) {
+        bitBuffer |= code << bitCount;
+        bitCount += codeSize;
+        while (bitCount >= 8) {
+            bytes.push_back(static_cast<unsigned char>(bitBuffer));
+            bitBuffer >>= 8;
+            bitCount -= 8;
+        }
+    };
+
+    writeCode(clearCode);
+    unsigned int prefix = indices[0];
+    for (size_t index = 1; index < indices.size(); ++index) {
+        unsigned int key = (prefix << 8) | indices[index];
+        unsigned int slot = (key * 0x9E3779B1u) >> 19;
+        while (tableCodes[slot] != -1 && tableKeys[slot] != key) {
+            slot = (slot + 1) & (tableSize - 1);
+        }
+        if (tableCodes[slot] != -1) {
+            prefix = tableCodes[slot];
+            continue;
+        }
+        writeCode(prefix);
+        unsigned int code = nextCode++;
+        tableKeys[slot] = key;
+        tableCodes[slot] = code;
+        if (code >= (1u << codeSize)) ++codeSize;
+        if (code == maxCode) {
+            writeCode(clearCode);
+            std::fill(tableCodes.begin(), tableCodes.end(), -1);
+            codeSize = minCodeSize + 1;
+            nextCode = endCode + 1;
+        }
+        prefix = indices[index];
+    }
+    writeCode(prefix);
+    // the decoder still adds an entry for the last code and may widen its codes before reading the end code
+    if (nextCode > endCode + 1 && nextCode >= (1u << codeSize) && codeSize < 12) ++codeSize;
+    writeCode(endCode);
+    if (bitCount > 0) bytes.push_back(static_cast<unsigned char>(bitBuffer));
+
+    std::fputc(minCodeSize, output);
+    for (size_t start = 0; start < bytes.size(); start += 255) {
+        size_t length = std::min<size_t>(255, bytes.size() - start);
+        std::fputc(static_cast<int>(length), output);
+        std::fwrite(&bytes[start], 1, length, output);
+    }
+    std::fputc(0, output);
+}
+
+// Opaque frames only send what changed and leave the rest on the canvas. Frames with transparency cannot turn a pixel
+// transparent again that way, so each is cropped to its own visible pixels and cleared before the next one instead.
+void WriteGIF(AnimationWriter &writer) {
+    const unsigned int width = writer.width, height = writer.height;
+    size_t frameSize = static_cast<size_t>(width) * height * writer.bytePerPixel;
+    ImageData strip;
+    strip.width = width;
+    strip.height = height * writer.frames.size();
+    strip.bytePerPixel = writer.bytePerPixel;
+    strip.upscaleRGBA = false;
+    strip.data = new unsigned char[frameSize * writer.frames.size()];
+    for (size_t frameId = 0; frameId < writer.frames.size(); ++frameId) {
+        std::memcpy(strip.data + frameSize * frameId, writer.frames[frameId].data(), frameSize);
+        std::vector<unsigned char>().swap(writer.frames[frameId]);
+    }
+    ColorPalette palette;
+    if (!BuildColorPalette(strip, palette)) QuantizeColorPalette(strip, palette);
+    delete[] strip.data;
+
+    int transparentIndex = -1;
+    for (size_t entry = 0; entry < palette.alpha.size() && transparentIndex < 0; ++entry) {
+        if (palette.alpha[entry] < 128) transparentIndex = static_cast<int>(entry);
+    }
+    if (transparentIndex >= 0) {
+        for (auto &index : palette.indices) {
+            if (palette.alpha[index] < 128) index = static_cast<unsigned char>(transparentIndex);
+        }
+    }
+    unsigned int colorBits = 1;
+    while ((1u << colorBits) < palette.colors.size()) ++colorBits;
+    std::cout << "INFO: writing gif with " << palette.colors.size() << " shared colors" << std::endl;
+
+    std::vector<unsigned char> header = {'G', 'I', 'F', '8', '9', 'a'};
+    AppendUInt16LE(header, width);
+    AppendUInt16LE(header, height);
+    header.push_back(static_cast<unsigned char>(0xF0 | (colorBits - 1)));  // global table, 8 bit color resolution
+    header.push_back(transparentIndex >= 0 ? transparentIndex : 0);
+    header.push_back(0);
+    for (unsigned int entry = 0; entry < (1u << colorBits); ++entry) {
+        png_color color = entry < palette.colors.size() ? palette.colors[entry] : png_color{0, 0, 0};
+        header.insert(header.end(), {color.red, color.green, color.blue});
+    }
+    // NETSCAPE2.0 extension, loop forever
+    const char *loop = "\x21\xFF\x0BNETSCAPE2.0\x03\x01\x00\x00\x00";
+    header.insert(header.end(), loop, loop + 19);
+    std::fwrite(header.data(), 1, header.size(), writer.output);
+
+    unsigned int minCodeSize = std::max(2u, colorBits);
+    unsigned int delay = std::max(2u, (writer.frameDelay + 5) / 10);
+    size_t pixelCount = static_cast<size_t>(width) * height;
+    for (size_t frameId = 0; frameId < writer.frames.size(); ++frameId) {
+        const unsigned char *current = &palette.indices[pixelCount * frameId];
+        FrameRect rect = {0, 0, width, height};
+        if (transparentIndex >= 0) {
+            std::vector<unsigned char> clear(pixelCount, static_cast<unsigned char>(transparentIndex));
+            rect = GetDirtyRect(clear.data(), current, width, height, 1);
+        } else if (frameId > 0) {
+            rect = GetDirtyRect(current - pixelCount, current, width, height, 1);
+        }
+        std::vector<unsigned char> control = {0x21, 0xF9, 0x04};
+        control.push_back(transparentIndex >= 0 ? (2 << 2) | 1 : (1 << 2));  // restore to background / do not dispose
+        AppendUInt16LE(control, delay);
+        control.push_back(transparentIndex >= 0 ? transparentIndex : 0);
+        control.push_back(0);
+        control.push_back(0x2C);
+        AppendUInt16LE(control, rect.x);
+        AppendUInt16LE(control, rect.y);
+        AppendUInt16LE(control, rect.width);
+        AppendUInt16LE(control, rect.height);
+        control.push_back(0);  // no local color table, not interlaced
+        std::fwrite(control.data(), 1, control.size(), writer.output);
+
+        std::vector<unsigned char> indices;
+        indices.reserve(static_cast<size_t>(rect.width) * rect.height);
+        for (unsigned int Y = rect.y; Y < rect.y + rect.height; ++Y) {
+            const unsigned char *row = current + static_cast<size_t>(Y) * width + rect.x;
+            indices.insert(indices.end(), row, row + rect.width);
+        }
+        WriteGIFImageData(writer.output, indices, minCodeSize);
+    }
+    std::fputc(0x3B, writer.output);
+}
+
+// format is "png" for APNG or "gif".
+AnimationWriter BeginAnimation(const std::string &filename, const std::string &format, unsigned int width,
+                               unsigned int height, unsigned int bytePerPixel, unsigned int frameCount,
+                               unsigned int frameDelay) {
+    AnimationWriter writer;
+    writer.gif = format == "gif";
+    writer.width = width;
+    writer.height = height;
+    writer.bytePerPixel = bytePerPixel;
+    writer.frameCount = frameCount;
+    writer.frameDelay = frameDelay;
+    writer.framesAdded = 0;
+    writer.sequenceNumber = 0;
+    if (writer.gif && (width > 0xFFFF || height > 0xFFFF)) {
+        std::cerr << "ERROR: gif frames are limited to 65535*65535" << std::endl;
+        exit(-1);
+    }
+    writer.output = std::fopen(filename.c_str(), "wb");
+    if (writer.output == nullptr) {
+        std::cerr << "ERROR: Unable to open output file \'" << filename << "\'" << std::endl;
+        exit(-1);
+    }
+    if (writer.gif) return writer;
+
+    const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    std::fwrite(signature, 1, 8, writer.output);
+    std::vector<unsigned char> header;
+    AppendUInt32BE(header, width);
+    AppendUInt32BE(header, height);
+    header.insert(header.end(), {8, static_cast<unsigned char>(bytePerPixel == 4 ? 6 : 2), 0, 0, 0});
+    WritePNGChunk(writer.output, "IHDR", header);
+    std::vector<unsigned char> control;
+    AppendUInt32BE(control, frameCount);
+    AppendUInt32BE(control, 0);  // loop forever
+    WritePNGChunk(writer.output, "acTL", control);
+    return writer;
+}
+
+void AddAnimationFrame(AnimationWriter &writer, const ImageData &image, bool flip) {
+    if (image.width != writer.width || image.height != writer.height || image.bytePerPixel != writer.bytePerPixel) {
+        std::cerr << "ERROR: animation frame differs in size or format from the first frame" << std::endl;
+        exit(-1);
+    }
+    size_t stride = static_cast<size_t>(image.width) * image.bytePerPixel;
+    std::vector<unsigned char> frame(stride * image.height);
+    for (unsigned int rowId = 0; rowId < image.height; ++rowId) {
+        std::memcpy(&frame[rowId * stride], GetImageRow(image, rowId, flip), stride);
+    }
+    if (writer.gif) {
+        writer.frames.push_back(std::move(frame));
+    } else {
+        FrameRect rect = {0, 0, writer.width, writer.height};
+        if (writer.framesAdded > 0) {
+            rect = GetDirtyRect(writer.previous.data(), frame.data(), writer.width, writer.height, writer.bytePerPixel);
+        }
+        WriteAPNGFrame(writer, frame.data(), rect);
+        writer.previous.swap(frame);
+    }
+    ++writer.framesAdded;
+}
+
+void FinishAnimation(AnimationWriter &writer) {
+    if (writer.framesAdded != writer.frameCount) {
+        std::cerr << "ERROR: animation got " << writer.framesAdded << " of " << writer.frameCount << " frames"
+                  << std::endl;
+        exit(-1);
+    }
+    if (writer.gif) {
+        WriteGIF(writer);
+    } else {
+        WritePNGChunk(writer.output, "IEND", {});
+    }
+    std::fclose(writer.output);
+}
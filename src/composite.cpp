@@ -0,0 +1,427 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// FNV-1a over the file content, missing files only contribute their name.
+unsigned long long HashFileContent(const std::string &filename, unsigned long long hash = 14695981039346656037ull) {
+    for (char character : filename) {
+        hash = (hash ^ static_cast<unsigned char>(character)) * 1099511628211ull;
+    }
+    std::ifstream input(filename, std::ios::binary | std::ios::in);
+    char buffer[4096];
+    while (input.is_open() && !input.eof()) {
+        input.read(buffer, sizeof(buffer));
+        for (std::streamsize index = 0; index < input.gcount(); ++index) {
+            hash = (hash ^ static_cast<unsigned char>(buffer[index])) * 1099511628211ull;
+        }
+    }
+    return hash;
+}
+
+inline unsigned long long HashValue(unsigned long long value, unsigned long long hash) {
+    for (size_t byteIndex = 0; byteIndex < 8; ++byteIndex) {
+        hash = (hash ^ ((value >> (byteIndex * 8)) & 0xFF)) * 1099511628211ull;
+    }
+    return hash;
+}
+
+inline unsigned long long HashString(const std::string &value, unsigned long long hash) {
+    for (char character : value) {
+        hash = (hash ^ static_cast<unsigned char>(character)) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// The model layer only depends on backend, skin, geometry, pose/camera and frame size, never on the background. The
+// backends draw different layers for the same arguments (isometric forces an orthographic camera), so each keeps its
+// own entries.
+std::string GetModelLayerCacheFile() {
+    unsigned long long hash = HashFileContent(Global::inputFilePath);
+    hash = HashString(Global::backend, hash);
+    hash = HashFileContent(Global::modelPath, hash);
+    hash = HashFileContent(Global::modelConfigPath, hash);
+    hash = HashFileContent(Global::vertexShaderPath, hash);
+    hash = HashFileContent(Global::fragmentShaderPath, hash);
+    hash = HashValue(Global::frameWidth, hash);
+    hash = HashValue(Global::frameHeight, hash);
+    hash = HashValue(Global::thinArm ? 1 : 0, hash);
+    hash = HashString(Global::cameras, hash);
+    hash = HashFileContent(Global::pose, hash);
+    hash = HashString(std::to_string(Global::poseTime), hash);
+    hash = HashValue(Global::samples, hash);
+    std::ostringstream name;
+    name << Global::layerCachePath << '/' << std::hex << std::setw(16) << std::setfill('0') << hash << ".rgba";
+    return name.str();
+}
+
+void PremultiplyAlpha(ImageData &image) {
+    size_t pixelCount = static_cast<size_t>(image.width) * image.height;
+    for (unsigned char *pixel = image.data; pixel != image.data + pixelCount * 4; pixel += 4) {
+        unsigned int alpha = pixel[3];
+        for (size_t channel = 0; channel < 3; ++channel) {
+            unsigned int value = pixel[channel] * alpha + 128;
+            pixel[channel] = static_cast<unsigned char>((value + (value >> 8)) >> 8);
+        }
+    }
+}
+
+void UnpremultiplyAlpha(ImageData &image) {
+    size_t pixelCount = static_cast<size_t>(image.width) * image.height;
+    for (unsigned char *pixel = image.data; pixel != image.data + pixelCount * 4; pixel += 4) {
+        unsigned int alpha = pixel[3];
+        if (alpha == 0 || alpha == 255) continue;
+        for (size_t channel = 0; channel < 3; ++channel) {
+            unsigned int value = (pixel[channel] * 255 + alpha / 2) / alpha;
+            pixel[channel] = static_cast<unsigned char>(value > 255 ? 255 : value);
+        }
+    }
+}
+
+// CPU equivalent of RenderBackground(): the plain color of bg_fragment_shader_plain.glsl, or the background image
+// stretched over the frame with the same bilinear/repeat sampling as the GL texture. Rows are bottom-up like GL.
+ImageData GetBackgroundLayer(unsigned int width, unsigned int height) {
+    ImageData layer;
+    layer.width = width;
+    layer.height = height;
+    layer.bytePerPixel = 4;
+    layer.upscaleRGBA = false;
+    layer.data = new unsigned char[static_cast<size_t>(width) * height * 4];
+    if (Global::backgroundPath.empty()) {
+        const unsigned char color[4] = {102, 204, 255, 255};
+        for (size_t pixelId = 0; pixelId < static_cast<size_t>(width) * height; ++pixelId) {
+            std::memcpy(&layer.data[pixelId * 4], color, 4);
+        }
+        return layer;
+    }
+
+    ImageData image = GetImageDataFromPNG(Global::backgroundPath, Global::signatureLength, true);
+    auto wrap = [](int value, int size) { return ((value % size) + size) % size; };
+    for (unsigned int Y = 0; Y < height; ++Y) {
+        float sourceY = (Y + 0.5f) / height * image.height - 0.5f;
+        int Y0 = static_cast<int>(std::floor(sourceY));
+        float fractionY = sourceY - Y0;
+        const unsigned char *row0 = &image.data[wrap(Y0, image.height) * image.width * 4];
+        const unsigned char *row1 = &image.data[wrap(Y0 + 1, image.height) * image.width * 4];
+        for (unsigned int X = 0; X < width; ++X) {
+            float sourceX = (X + 0.5f) / width * image.width - 0.5f;
+            int X0 = static_cast<int>(std::floor(sourceX));
+            float fractionX = sourceX - X0;
+            int column0 = wrap(X0, image.width) * 4;
+            int column1 = wrap(X0 + 1, image.width) * 4;
+            unsigned char *pixel = &layer.data[(static_cast<size_t>(Y) * width + X) * 4];
+            for (size_t channel = 0; channel < 3; ++channel) {
+                float top = row0[column0 + channel] * (1.0f - fractionX) + row0[column1 + channel] * fractionX;
+                float bottom = row1[column0 + channel] * (1.0f - fractionX) + row1[column1 + channel] * fractionX;
+                pixel[channel] = static_cast<unsigned char>(top * (1.0f - fractionY) + bottom * fractionY + 0.5f);
+            }
+            pixel[3] = 255;  // the readback ignores background alpha
+        }
+    }
+    delete[] image.data;
+    return layer;
+}
+
+// target = layer over target, both RGBA with premultiplied alpha and of the same size.
+void CompositeLayerOver(const ImageData &layer, ImageData &target) {
+    size_t pixelCount = static_cast<size_t>(layer.width) * layer.height;
+    size_t pixelId = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i full = _mm_set1_epi16(255);
+    const __m128i bias = _mm_set1_epi16(128);
+    const __m128i scale = _mm_set1_epi16(257);
+    for (; pixelId + 4 <= pixelCount; pixelId += 4) {
+        __m128i source = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&layer.data[pixelId * 4]));
+        __m128i destination = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&target.data[pixelId * 4]));
+        __m128i sourceLow = _mm_unpacklo_epi8(source, zero);
+        __m128i sourceHigh = _mm_unpackhi_epi8(source, zero);
+        __m128i alphaLow = _mm_shufflehi_epi16(_mm_shufflelo_epi16(sourceLow, 0xFF), 0xFF);
+        __m128i alphaHigh = _mm_shufflehi_epi16(_mm_shufflelo_epi16(sourceHigh, 0xFF), 0xFF);
+        // destination * (255 - alpha) / 255, rounded
+        __m128i low = _mm_mullo_epi16(_mm_unpacklo_epi8(destination, zero), _mm_sub_epi16(full, alphaLow));
+        __m128i high = _mm_mullo_epi16(_mm_unpackhi_epi8(destination, zero), _mm_sub_epi16(full, alphaHigh));
+        low = _mm_mulhi_epu16(_mm_add_epi16(low, bias), scale);
+        high = _mm_mulhi_epu16(_mm_add_epi16(high, bias), scale);
+        __m128i result = _mm_packus_epi16(_mm_add_epi16(sourceLow, low), _mm_add_epi16(sourceHigh, high));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(&target.data[pixelId * 4]), result);
+    }
+#endif
+    for (; pixelId < pixelCount; ++pixelId) {
+        const unsigned char *source = &layer.data[pixelId * 4];
+        unsigned char *destination = &target.data[pixelId * 4];
+        unsigned int inverseAlpha = 255 - source[3];
+        for (size_t channel = 0; channel < 4; ++channel) {
+            unsigned int value = (destination[channel] * inverseAlpha + 128) * 257 >> 16;
+            value += source[channel];
+            destination[channel] = static_cast<unsigned char>(value > 255 ? 255 : value);
+        }
+    }
+}
+
+ImageData DropAlphaChannel(const ImageData &image) {
+    ImageData result = image;
+    result.bytePerPixel = 3;
+    size_t pixelCount = static_cast<size_t>(image.width) * image.height;
+    result.data = new unsigned char[pixelCount * 3];
+    for (size_t pixelId = 0; pixelId < pixelCount; ++pixelId) {
+        std::memcpy(&result.data[pixelId * 3], &image.data[pixelId * 4], 3);
+    }
+    return result;
+}
+
+// Turns a premultiplied model layer into the final frame without any GL work.
+ImageData ComposeModelLayer(const ImageData &layer) {
+    if (Global::transparentBackground) {
+        ImageData result = layer;
+        result.data = new unsigned char[static_cast<size_t>(layer.width) * layer.height * 4];
+        std::memcpy(result.data, layer.data, static_cast<size_t>(layer.width) * layer.height * 4);
+        UnpremultiplyAlpha(result);
+        return result;
+    }
+    ImageData background = GetBackgroundLayer(layer.width, layer.height);
+    CompositeLayerOver(layer, background);
+    ImageData result = DropAlphaChannel(background);
+    delete[] background.data;
+    return result;
+}
+
+// Nearest-neighbor upscale of a RGBA image into a sub-rectangle of a RGBA target. Each distinct source row is expanded
+// once and then copied for every target row that maps onto it.
+void UpscaleNearest(const ImageData &source, ImageData &target, unsigned int targetX, unsigned int targetY,
+                    unsigned int width, unsigned int height) {
+    std::vector<unsigned int> columnMap(width);
+    for (unsigned int X = 0; X < width; ++X) {
+        columnMap[X] = static_cast<unsigned int>(static_cast<unsigned long long>(X) * source.width / width);
+    }
+    bool integerScale = width % source.width == 0;
+    unsigned int scale = width / source.width;
+    const unsigned char *expandedRow = nullptr;
+    unsigned int expandedSourceRow = source.height;
+    for (unsigned int Y = 0; Y < height; ++Y) {
+        unsigned int sourceRow = static_cast<unsigned int>(static_cast<unsigned long long>(Y) * source.height / height);
+        unsigned char *row = &target.data[(static_cast<size_t>(targetY + Y) * target.width + targetX) * 4];
+        if (sourceRow == expandedSourceRow) {
+            std::memcpy(row, expandedRow, static_cast<size_t>(width) * 4);
+            continue;
+        }
+        const unsigned int *sourcePixels = reinterpret_cast<const unsigned int *>(
+            &source.data[static_cast<size_t>(sourceRow) * source.width * 4]);
+        unsigned int *targetPixels = reinterpret_cast<unsigned int *>(row);
+#ifdef __SSE2__
+        if (integerScale && scale >= 4) {
+            for (unsigned int X = 0; X < source.width; ++X) {
+                __m128i pixel = _mm_set1_epi32(static_cast<int>(sourcePixels[X]));
+                unsigned int *span = &targetPixels[X * scale];
+                unsigned int offset = 0;
+                for (; offset + 4 <= scale; offset += 4) {
+                    _mm_storeu_si128(reinterpret_cast<__m128i *>(&span[offset]), pixel);
+                }
+                for (; offset < scale; ++offset) span[offset] = sourcePixels[X];
+            }
+        } else
+#endif
+        {
+            for (unsigned int X = 0; X < width; ++X) {
+                targetPixels[X] = sourcePixels[columnMap[X]];
+            }
+        }
+        expandedRow = row;
+        expandedSourceRow = sourceRow;
+    }
+}
+
+// view=face: head front (8,8) with the hat overlay (40,8) on top, using the same rules as model_fragment_shader.glsl.
+// The skin is bottom-up as loaded by LoadSkinImage, the result is a square, straight alpha, bottom-up RGBA image.
+ImageData ComposeFace(const ImageData &skin) {
+    unsigned int unit = skin.width / 64;
+    unsigned int size = 8 * unit;
+    ImageData face;
+    face.width = size;
+    face.height = size;
+    face.bytePerPixel = 4;
+    face.upscaleRGBA = false;
+    face.data = new unsigned char[size * size * 4];
+    for (unsigned int Y = 0; Y < size; ++Y) {
+        // skin coordinates are top-down, rows are stored bottom-up
+        unsigned int skinRow = skin.height - 1 - (8 * unit + (size - 1 - Y));
+        const unsigned char *base = &skin.data[(static_cast<size_t>(skinRow) * skin.width + 8 * unit) * 4];
+        const unsigned char *hat = &skin.data[(static_cast<size_t>(skinRow) * skin.width + 40 * unit) * 4];
+        for (unsigned int X = 0; X < size; ++X, base += 4, hat += 4) {
+            unsigned char *pixel = &face.data[(static_cast<size_t>(Y) * size + X) * 4];
+            bool hatVisible = hat[3] == 255 && !(skin.upscaleRGBA && hat[0] == 0 && hat[1] == 0 && hat[2] == 0);
+            if (hatVisible) {
+                std::memcpy(pixel, hat, 4);
+            } else if (base[3] == 255) {
+                std::memcpy(pixel, base, 4);
+            } else {
+                pixel[0] = pixel[1] = pixel[2] = 0;
+                pixel[3] = 255;
+            }
+        }
+    }
+    return face;
+}
+
+// Copies a width x height block out of an image of the same pixel format.
+ImageData CropImage(const ImageData &source, unsigned int x, unsigned int y, unsigned int width, unsigned int height) {
+    ImageData target;
+    target.width = width;
+    target.height = height;
+    target.bytePerPixel = source.bytePerPixel;
+    target.upscaleRGBA = source.upscaleRGBA;
+    target.data = new unsigned char[static_cast<size_t>(width) * height * target.bytePerPixel];
+    size_t rowSize = static_cast<size_t>(width) * target.bytePerPixel;
+    for (unsigned int row = 0; row < height; ++row) {
+        std::memcpy(&target.data[row * rowSize],
+                    &source.data[((static_cast<size_t>(y) + row) * source.width + x) * source.bytePerPixel], rowSize);
+    }
+    return target;
+}
+
+void PasteImage(const ImageData &source, ImageData &target, unsigned int x, unsigned int y) {
+    size_t rowSize = static_cast<size_t>(source.width) * source.bytePerPixel;
+    for (unsigned int row = 0; row < source.height; ++row) {
+        std::memcpy(&target.data[((static_cast<size_t>(y) + row) * target.width + x) * target.bytePerPixel],
+                    &source.data[row * rowSize], rowSize);
+    }
+}
+
+// Box filter downscale by an integer factor, each target pixel averages a factor x factor block. Used to compare
+// against MSAA, see BenchmarkAntialiasing.
+ImageData ShrinkImage(const ImageData &source, unsigned int factor) {
+    ImageData target;
+    target.width = source.width / factor;
+    target.height = source.height / factor;
+    target.bytePerPixel = source.bytePerPixel;
+    target.upscaleRGBA = source.upscaleRGBA;
+    target.data = new unsigned char[static_cast<size_t>(target.width) * target.height * target.bytePerPixel];
+    unsigned int area = factor * factor;
+    std::vector<unsigned int> sums(static_cast<size_t>(target.width) * target.bytePerPixel);
+    for (unsigned int Y = 0; Y < target.height; ++Y) {
+        std::fill(sums.begin(), sums.end(), 0);
+        for (unsigned int subY = 0; subY < factor; ++subY) {
+            size_t sourceY = static_cast<size_t>(Y) * factor + subY;
+            const unsigned char *row = &source.data[sourceY * source.width * source.bytePerPixel];
+            for (unsigned int X = 0; X < target.width; ++X) {
+                for (unsigned int subX = 0; subX < factor; ++subX) {
+                    const unsigned char *pixel = row + (static_cast<size_t>(X) * factor + subX) * source.bytePerPixel;
+                    for (unsigned int byteIndex = 0; byteIndex < source.bytePerPixel; ++byteIndex) {
+                        sums[X * source.bytePerPixel + byteIndex] += pixel[byteIndex];
+                    }
+                }
+            }
+        }
+        unsigned char *targetRow = &target.data[static_cast<size_t>(Y) * target.width * target.bytePerPixel];
+        for (size_t index = 0; index < sums.size(); ++index) {
+            targetRow[index] = static_cast<unsigned char>((sums[index] + area / 2) / area);
+        }
+    }
+    return target;
+}
+
+struct BoxFilterTap {
+    unsigned int first;                 // first source pixel
+    std::vector<unsigned int> weights;  // one per source pixel from 'first' on, summing to 1 << 15
+};
+
+// Output pixel i covers [i, i + 1) * sourceSize / targetSize of the source, every source pixel is weighted by how much
+// of it lies inside.
+std::vector<BoxFilterTap> GetBoxFilterTaps(unsigned int sourceSize, unsigned int targetSize) {
+    std::vector<BoxFilterTap> taps(targetSize);
+    double ratio = static_cast<double>(sourceSize) / targetSize;
+    for (unsigned int index = 0; index < targetSize; ++index) {
+        double begin = index * ratio, end = std::min((index + 1) * ratio, static_cast<double>(sourceSize));
+        BoxFilterTap &tap = taps[index];
+        tap.first = std::min(static_cast<unsigned int>(begin), sourceSize - 1);
+        unsigned int last = std::max(static_cast<unsigned int>(std::ceil(end)), tap.first + 1);
+        unsigned int total = 0;
+        for (unsigned int source = tap.first; source < last; ++source) {
+            double overlap = std::min(end, source + 1.0) - std::max(begin, static_cast<double>(source));
+            double share = std::max(overlap, 0.0) / (end - begin);
+            unsigned int weight = static_cast<unsigned int>(std::lround(share * 32768));
+            tap.weights.push_back(weight);
+            total += weight;
+        }
+        // rounding leftovers go to the largest weight, so a flat image stays flat
+        auto largest = std::max_element(tap.weights.begin(), tap.weights.end());
+        *largest = *largest + 32768 - total;
+    }
+    return taps;
+}
+
+// Area averaging resize for downscales by any ratio, separable: rows are filtered horizontally into an intermediate
+// image first, then the vertical pass blends whole rows, eight channels at a time with SSE2.
+ImageData ResizeImage(const ImageData &source, unsigned int width, unsigned int height) {
+    if (source.width % width == 0 && source.height % height == 0 && source.width / width == source.height / height) {
+        return ShrinkImage(source, source.width / width);
+    }
+    unsigned int bytePerPixel = source.bytePerPixel;
+    size_t rowSize = static_cast<size_t>(width) * bytePerPixel;
+    std::vector<BoxFilterTap> columns = GetBoxFilterTaps(source.width, width);
+    std::vector<BoxFilterTap> rows = GetBoxFilterTaps(source.height, height);
+    std::vector<unsigned char> horizontal(rowSize * source.height);
+    for (unsigned int Y = 0; Y < source.height; ++Y) {
+        const unsigned char *sourceRow = &source.data[static_cast<size_t>(Y) * source.width * bytePerPixel];
+        unsigned char *targetRow = &horizontal[Y * rowSize];
+        for (unsigned int X = 0; X < width; ++X) {
+            const BoxFilterTap &tap = columns[X];
+            for (unsigned int byteIndex = 0; byteIndex < bytePerPixel; ++byteIndex) {
+                unsigned int sum = 1 << 14;
+                for (size_t offset = 0; offset < tap.weights.size(); ++offset) {
+                    sum += tap.weights[offset] * sourceRow[(tap.first + offset) * bytePerPixel + byteIndex];
+                }
+                targetRow[X * bytePerPixel + byteIndex] = static_cast<unsigned char>(sum >> 15);
+            }
+        }
+    }
+
+    ImageData target;
+    target.width = width;
+    target.height = height;
+    target.bytePerPixel = bytePerPixel;
+    target.upscaleRGBA = source.upscaleRGBA;
+    target.data = new unsigned char[rowSize * height];
+    std::vector<unsigned int> sums(rowSize);
+    for (unsigned int Y = 0; Y < height; ++Y) {
+        const BoxFilterTap &tap = rows[Y];
+        std::fill(sums.begin(), sums.end(), 1 << 14);
+        for (size_t offset = 0; offset < tap.weights.size(); ++offset) {
+            const unsigned char *row = &horizontal[(tap.first + offset) * rowSize];
+            unsigned int weight = tap.weights[offset];
+            size_t index = 0;
+#ifdef __SSE2__
+            // weight * value needs 23 bits: low and high halves of the 16 bit products are interleaved into 32 bits
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i weights = _mm_set1_epi16(static_cast<short>(weight));
+            for (; index + 8 <= rowSize; index += 8) {
+                __m128i packed = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(&row[index]));
+                __m128i values = _mm_unpacklo_epi8(packed, zero);
+                __m128i low = _mm_mullo_epi16(values, weights);
+                __m128i high = _mm_mulhi_epu16(values, weights);
+                __m128i *sum = reinterpret_cast<__m128i *>(&sums[index]);
+                _mm_storeu_si128(sum, _mm_add_epi32(_mm_loadu_si128(sum), _mm_unpacklo_epi16(low, high)));
+                _mm_storeu_si128(sum + 1, _mm_add_epi32(_mm_loadu_si128(sum + 1), _mm_unpackhi_epi16(low, high)));
+            }
+#endif
+            for (; index < rowSize; ++index) {
+                sums[index] += weight * row[index];
+            }
+        }
+        unsigned char *targetRow = &target.data[Y * rowSize];
+        for (size_t index = 0; index < rowSize; ++index) {
+            targetRow[index] = static_cast<unsigned char>(sums[index] >> 15);
+        }
+    }
+    return target;
+}
@@ -0,0 +1,61 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+// Per-skin alpha coverage of the model faces. An attachment face whose texels would all be discarded by
+// model_fragment_shader.glsl (not fully opaque, or black on an upscaled RGB skin) never contributes a fragment and can
+// be left out of the draw list.
+
+inline glm::vec2 GetFaceTextureCoord(const ModelVertex &vertex) { return vertex.textureCoord; }
+
+inline glm::vec2 GetFaceTextureCoord(const PackedModelVertex &vertex) {
+    return glm::vec2(vertex.textureCoord[0], vertex.textureCoord[1]) / 64.0f;
+}
+
+// Fraction of the texels in the face's UV rectangle that survive the attachment discard rules.
+template <typename Vertex>
+float GetAttachmentFaceCoverage(const Vertex *face, const ImageData &skin) {
+    glm::vec2 minCoord = GetFaceTextureCoord(face[0]), maxCoord = minCoord;
+    for (size_t index = 1; index < 4; ++index) {
+        minCoord = glm::min(minCoord, GetFaceTextureCoord(face[index]));
+        maxCoord = glm::max(maxCoord, GetFaceTextureCoord(face[index]));
+    }
+    float minU = minCoord.x, maxU = maxCoord.x, minV = minCoord.y, maxV = maxCoord.y;
+    int beginX = std::max(0, static_cast<int>(std::floor(minU * skin.width)));
+    int endX = std::min(static_cast<int>(skin.width), static_cast<int>(std::ceil(maxU * skin.width)));
+    int beginY = std::max(0, static_cast<int>(std::floor(minV * skin.height)));
+    int endY = std::min(static_cast<int>(skin.height), static_cast<int>(std::ceil(maxV * skin.height)));
+    // degenerate rectangles sample a single texel
+    endX = std::max(endX, std::min(beginX + 1, static_cast<int>(skin.width)));
+    endY = std::max(endY, std::min(beginY + 1, static_cast<int>(skin.height)));
+    size_t visible = 0, total = 0;
+    for (int Y = beginY; Y < endY; ++Y) {
+        for (int X = beginX; X < endX; ++X) {
+            const unsigned char *texel = &skin.data[(static_cast<size_t>(Y) * skin.width + X) * 4];
+            bool discarded = texel[3] != 255 || (skin.upscaleRGBA && texel[0] == 0 && texel[1] == 0 && texel[2] == 0);
+            visible += discarded ? 0 : 1;
+            ++total;
+        }
+    }
+    return total == 0 ? 0.0f : static_cast<float>(visible) / total;
+}
+
+// Keeps the attachment faces that at least one of the skins drawn with this geometry covers.
+template <typename Geometry>
+void DropTransparentAttachmentFaces(Geometry &geometry, const std::vector<ImageData> &skins) {
+    decltype(geometry.attachmentVertices) kept;
+    kept.reserve(geometry.attachmentVertices.size());
+    for (size_t faceStart = 0; faceStart + 4 <= geometry.attachmentVertices.size(); faceStart += 4) {
+        bool covered = false;
+        for (auto &skin : skins) {
+            covered = covered || GetAttachmentFaceCoverage(&geometry.attachmentVertices[faceStart], skin) > 0.0f;
+        }
+        if (!covered) continue;
+        kept.insert(kept.end(), geometry.attachmentVertices.begin() + faceStart,
+                    geometry.attachmentVertices.begin() + faceStart + 4);
+    }
+    std::cout << "INFO: drawing " << kept.size() / 4 << " of " << geometry.attachmentVertices.size() / 4
+              << " attachment faces" << std::endl;
+    geometry.attachmentVertices.swap(kept);
+}
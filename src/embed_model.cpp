@@ -0,0 +1,107 @@
+// Build time generator for embedded_model.h: parses the shipped Steve/Alex models and default.mconf with the
+// renderer's own loaders and writes them out as constexpr tables, see embedded.cpp.
+// Usage: EmbedModel <output header> <Steve.obj> <Alex.obj> <default.mconf>
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <string>
+
+#include "model.cpp"
+
+std::string FormatFloat(float value) {
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%.9g", value);
+    std::string text(buffer);
+    if (text.find_first_of(".en") == std::string::npos) text += ".0";
+    return text + 'f';
+}
+
+std::string FormatVec3(const glm::vec3 &value) {
+    return '{' + FormatFloat(value.x) + ", " + FormatFloat(value.y) + ", " + FormatFloat(value.z) + '}';
+}
+
+void WriteModel(std::FILE *output, const std::string &name, std::map<std::string, ObjModel> &models) {
+    std::string vertices, textureCoords, faceElements, groups;
+    size_t vertexCount = 0, textureCoordCount = 0, faceCount = 0;
+    for (auto &group : models) {
+        size_t vertexBegin = vertexCount, textureCoordBegin = textureCoordCount, faceBegin = faceCount;
+        for (auto &vertex : group.second.vertices) {
+            vertices += "    " + FormatFloat(vertex.x) + ", " + FormatFloat(vertex.y) + ", " + FormatFloat(vertex.z) + ",\n";
+            ++vertexCount;
+        }
+        for (auto &textureCoord : group.second.textureCoords) {
+            textureCoords += "    " + FormatFloat(textureCoord.x) + ", " + FormatFloat(textureCoord.y) + ",\n";
+            ++textureCoordCount;
+        }
+        for (auto &face : group.second.faces) {
+            faceElements += "   ";
+            for (size_t i = 0; i < 4; ++i) {
+                faceElements += ' ' + std::to_string(face.element[i].vertexIndex) + ", " +
+                                std::to_string(face.element[i].textureCoordIndex) + ',';
+            }
+            faceElements += '\n';
+            ++faceCount;
+        }
+        groups += "    {\"" + group.first + "\", " + std::to_string(vertexBegin) + ", " + std::to_string(vertexCount) +
+                  ", " + std::to_string(textureCoordBegin) + ", " + std::to_string(textureCoordCount) + ", " +
+                  std::to_string(faceBegin) + ", " + std::to_string(faceCount) + "},\n";
+    }
+    std::fprintf(output, "constexpr float embedded%sVertices[] = {\n%s};\n", name.c_str(), vertices.c_str());
+    std::fprintf(output, "constexpr float embedded%sTextureCoords[] = {\n%s};\n", name.c_str(), textureCoords.c_str());
+    std::fprintf(output, "constexpr unsigned int embedded%sFaceElements[] = {\n%s};\n", name.c_str(),
+                 faceElements.c_str());
+    std::fprintf(output, "constexpr EmbeddedObjGroup embedded%sGroups[] = {\n%s};\n", name.c_str(), groups.c_str());
+    std::fprintf(output,
+                 "constexpr EmbeddedObjModel embedded%s = {\"%s\", embedded%sVertices, embedded%sTextureCoords, "
+                 "embedded%sFaceElements, embedded%sGroups, %zu};\n\n",
+                 name.c_str(), name.c_str(), name.c_str(), name.c_str(), name.c_str(), name.c_str(), models.size());
+}
+
+void WriteModelConfig(std::FILE *output, ModelConfig &config) {
+    std::string origins, attachmentScales, pivots;
+    for (auto &origin : config.origins) {
+        origins += "    {\"" + origin.first + "\", " + FormatVec3(origin.second) + "},\n";
+    }
+    for (auto &scale : config.attachmentScales) {
+        attachmentScales += "    {\"" + scale.first + "\", " + FormatFloat(scale.second) + "},\n";
+    }
+    for (auto &pivot : config.pivots) {
+        pivots += "    {\"" + pivot.first + "\", " + FormatVec3(pivot.second) + "},\n";
+    }
+    std::fprintf(output, "constexpr EmbeddedVec3Entry embeddedOrigins[] = {\n%s};\n", origins.c_str());
+    std::fprintf(output, "constexpr EmbeddedFloatEntry embeddedAttachmentScales[] = {\n%s};\n",
+                 attachmentScales.c_str());
+    // an empty initializer list is not a valid array, keep a placeholder that the count excludes
+    std::fprintf(output, "constexpr EmbeddedVec3Entry embeddedPivots[] = {\n%s};\n",
+                 pivots.empty() ? "    {\"\", {0.0f, 0.0f, 0.0f}},\n" : pivots.c_str());
+    std::fprintf(output,
+                 "constexpr EmbeddedModelConfig embeddedModelConfig = {%s, %s, %s, %s, %s, embeddedOrigins, %zu, "
+                 "embeddedAttachmentScales, %zu, embeddedPivots, %zu};\n",
+                 FormatVec3(config.eyePosition).c_str(), FormatVec3(config.eyeTarget).c_str(),
+                 FormatVec3(config.eyeUpDirection).c_str(), config.orthographic ? "true" : "false",
+                 FormatFloat(config.orthoHeight).c_str(), config.origins.size(), config.attachmentScales.size(),
+                 config.pivots.size());
+}
+
+int main(int argc, char **argv) {
+    if (argc != 5) {
+        std::cerr << "Usage: " << argv[0] << " <output header> <Steve.obj> <Alex.obj> <default.mconf>" << std::endl;
+        return -1;
+    }
+    auto steve = LoadObjModel(argv[2], 64, 64);
+    auto alex = LoadObjModel(argv[3], 64, 64);
+    auto config = LoadModelConfig(argv[4]);
+    std::FILE *output = std::fopen(argv[1], "w");
+    if (output == nullptr) {
+        std::cerr << "ERROR: Unable to open \'" << argv[1] << "\' for writing" << std::endl;
+        return -1;
+    }
+    std::fprintf(output, "// Generated by EmbedModel from %s, %s and %s, do not edit.\n\n", argv[2], argv[3], argv[4]);
+    WriteModel(output, "Steve", steve);
+    WriteModel(output, "Alex", alex);
+    WriteModelConfig(output, config);
+    std::fclose(output);
+    return 0;
+}
@@ -0,0 +1,132 @@
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+
+// The shipped Steve/Alex models and default.mconf, compiled into the binary by EmbedModel (embed_model.cpp). They
+// are used whenever model= or modelConfig= is not given, so a default render touches no resource files.
+
+struct EmbeddedObjGroup {
+    const char *name;
+    unsigned int vertexBegin, vertexEnd;              // three floats per vertex
+    unsigned int textureCoordBegin, textureCoordEnd;  // two floats per coordinate, already normalized and flipped
+    unsigned int faceBegin, faceEnd;                  // four (vertex, texture coordinate) index pairs per face
+};
+
+struct EmbeddedObjModel {
+    const char *name;
+    const float *vertices;
+    const float *textureCoords;
+    const unsigned int *faceElements;
+    const EmbeddedObjGroup *groups;
+    unsigned int groupCount;
+};
+
+struct EmbeddedVec3Entry {
+    const char *name;
+    float value[3];
+};
+
+struct EmbeddedFloatEntry {
+    const char *name;
+    float value;
+};
+
+struct EmbeddedModelConfig {
+    float eyePosition[3];
+    float eyeTarget[3];
+    float eyeUpDirection[3];
+    bool orthographic;
+    float orthoHeight;
+    const EmbeddedVec3Entry *origins;
+    unsigned int originCount;
+    const EmbeddedFloatEntry *attachmentScales;
+    unsigned int attachmentScaleCount;
+    const EmbeddedVec3Entry *pivots;
+    unsigned int pivotCount;
+};
+
+#include "embedded_model.h"
+
+std::map<std::string, ObjModel> GetEmbeddedObjModel(const EmbeddedObjModel &model) {
+    std::map<std::string, ObjModel> ret;
+    for (unsigned int groupId = 0; groupId < model.groupCount; ++groupId) {
+        const EmbeddedObjGroup &group = model.groups[groupId];
+        ObjModel &current = ret[group.name];
+        for (unsigned int index = group.vertexBegin; index < group.vertexEnd; ++index) {
+            const float *vertex = &model.vertices[index * 3];
+            current.vertices.push_back(glm::vec4(vertex[0], vertex[1], vertex[2], 1.0f));
+        }
+        for (unsigned int index = group.textureCoordBegin; index < group.textureCoordEnd; ++index) {
+            const float *textureCoord = &model.textureCoords[index * 2];
+            current.textureCoords.push_back(glm::vec2(textureCoord[0], textureCoord[1]));
+        }
+        for (unsigned int index = group.faceBegin; index < group.faceEnd; ++index) {
+            Face face;
+            for (size_t i = 0; i < 4; ++i) {
+                face.element[i].vertexIndex = model.faceElements[index * 8 + i * 2];
+                face.element[i].textureCoordIndex = model.faceElements[index * 8 + i * 2 + 1];
+                face.element[i].normalIndex = 0;
+            }
+            current.faces.push_back(face);
+        }
+    }
+    return ret;
+}
+
+ModelConfig GetEmbeddedModelConfig() {
+    const EmbeddedModelConfig &embedded = embeddedModelConfig;
+    ModelConfig ret;
+    ret.eyePosition = glm::vec3(embedded.eyePosition[0], embedded.eyePosition[1], embedded.eyePosition[2]);
+    ret.eyeTarget = glm::vec3(embedded.eyeTarget[0], embedded.eyeTarget[1], embedded.eyeTarget[2]);
+    ret.eyeUpDirection = glm::vec3(embedded.eyeUpDirection[0], embedded.eyeUpDirection[1], embedded.eyeUpDirection[2]);
+    ret.orthographic = embedded.orthographic;
+    ret.orthoHeight = embedded.orthoHeight;
+    for (unsigned int index = 0; index < embedded.originCount; ++index) {
+        const EmbeddedVec3Entry &origin = embedded.origins[index];
+        ret.origins[origin.name] = glm::vec3(origin.value[0], origin.value[1], origin.value[2]);
+    }
+    for (unsigned int index = 0; index < embedded.attachmentScaleCount; ++index) {
+        ret.attachmentScales[embedded.attachmentScales[index].name] = embedded.attachmentScales[index].value;
+    }
+    for (unsigned int index = 0; index < embedded.pivotCount; ++index) {
+        const EmbeddedVec3Entry &pivot = embedded.pivots[index];
+        ret.pivots[pivot.name] = glm::vec3(pivot.value[0], pivot.value[1], pivot.value[2]);
+    }
+    return ret;
+}
+
+// model= if given, otherwise the embedded Steve, or Alex with thinArm=1.
+std::map<std::string, ObjModel> LoadSelectedModel() {
+    if (!Global::modelPath.empty()) return LoadObjModel(Global::modelPath, 64, 64);
+    const EmbeddedObjModel &model = Global::thinArm ? embeddedAlex : embeddedSteve;
+    std::cout << "INFO: using the embedded " << model.name << " model" << std::endl;
+    return GetEmbeddedObjModel(model);
+}
+
+ModelConfig LoadSelectedModelConfig() {
+    if (!Global::modelConfigPath.empty()) return LoadModelConfig(Global::modelConfigPath);
+    return GetEmbeddedModelConfig();
+}
+
+// The views to render: the config's cameras, or cameras=x,y,z;x,y,z;... eye positions looking at the first camera's
+// target.
+std::vector<ModelCamera> GetSelectedCameras(const ModelConfig &config) {
+    std::vector<ModelCamera> cameras = GetModelCameras(config);
+    if (Global::cameras.empty()) return cameras;
+    ModelCamera base = cameras.front();
+    cameras.clear();
+    std::istringstream list(Global::cameras);
+    std::string entry;
+    while (std::getline(list, entry, ';')) {
+        ModelCamera camera = base;
+        if (std::sscanf(entry.c_str(), "%f,%f,%f", &camera.eyePosition.x, &camera.eyePosition.y,
+                        &camera.eyePosition.z) != 3) {
+            std::cerr << "ERROR: Malformed camera \'" << entry << "\'" << std::endl;
+            exit(-1);
+        }
+        cameras.push_back(camera);
+    }
+    return cameras;
+}
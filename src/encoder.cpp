@@ -0,0 +1,281 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#ifdef WITH_WEBP
+#include <webp/encode.h>
+#endif
+
+typedef void (*ImageEncodeFunction)(ImageData &image, std::FILE *output, bool flip);
+
+struct ImageEncoder {
+    std::string name;
+    std::string extension;
+    ImageEncodeFunction encode;
+};
+
+inline const unsigned char *GetImageRow(const ImageData &image, unsigned int rowId, bool flip) {
+    unsigned int sourceRow = flip ? image.height - 1 - rowId : rowId;
+    return &image.data[static_cast<size_t>(sourceRow) * image.width * image.bytePerPixel];
+}
+
+inline void WriteUInt32LE(std::FILE *output, unsigned int value) {
+    unsigned char bytes[4] = {static_cast<unsigned char>(value), static_cast<unsigned char>(value >> 8),
+                              static_cast<unsigned char>(value >> 16), static_cast<unsigned char>(value >> 24)};
+    std::fwrite(bytes, 1, 4, output);
+}
+
+void EncodePNG(ImageData &image, std::FILE *output, bool flip) {
+    if (Global::paletteOutput) {
+        WriteImageDataToPalettePNG(image, output, flip, Global::paletteQuantize);
+    } else {
+        WriteImageDataToPNG(image, output, flip);
+    }
+}
+
+// QOI, see https://qoiformat.org/qoi-specification.pdf
+void EncodeQOI(ImageData &image, std::FILE *output, bool flip) {
+    const unsigned char opIndex = 0x00, opDiff = 0x40, opLuma = 0x80, opRun = 0xC0, opRGB = 0xFE, opRGBA = 0xFF;
+    const unsigned char endMarker[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+    std::vector<unsigned char> buffer;
+    buffer.reserve(static_cast<size_t>(image.width) * image.height * (image.bytePerPixel + 1) + 22);
+    buffer.insert(buffer.end(), {'q', 'o', 'i', 'f'});
+    for (unsigned int value : {image.width, image.height}) {
+        buffer.push_back(static_cast<unsigned char>(value >> 24));
+        buffer.push_back(static_cast<unsigned char>(value >> 16));
+        buffer.push_back(static_cast<unsigned char>(value >> 8));
+        buffer.push_back(static_cast<unsigned char>(value));
+    }
+    buffer.push_back(static_cast<unsigned char>(image.bytePerPixel == 4 ? 4 : 3));
+    buffer.push_back(0);  // sRGB with linear alpha
+
+    unsigned char index[64][4];
+    std::memset(index, 0, sizeof(index));
+    unsigned char previous[4] = {0, 0, 0, 255};
+    unsigned char current[4] = {0, 0, 0, 255};
+    unsigned int run = 0;
+    size_t pixelCount = static_cast<size_t>(image.width) * image.height;
+    size_t pixelId = 0;
+    for (unsigned int rowId = 0; rowId < image.height; ++rowId) {
+        const unsigned char *pixel = GetImageRow(image, rowId, flip);
+        for (unsigned int columnId = 0; columnId < image.width; ++columnId, ++pixelId, pixel += image.bytePerPixel) {
+            std::memcpy(current, pixel, image.bytePerPixel);
+            if (std::memcmp(current, previous, 4) == 0) {
+                ++run;
+                if (run == 62 || pixelId + 1 == pixelCount) {
+                    buffer.push_back(static_cast<unsigned char>(opRun | (run - 1)));
+                    run = 0;
+                }
+                continue;
+            }
+            if (run > 0) {
+                buffer.push_back(static_cast<unsigned char>(opRun | (run - 1)));
+                run = 0;
+            }
+            unsigned int hash = (current[0] * 3 + current[1] * 5 + current[2] * 7 + current[3] * 11) % 64;
+            if (std::memcmp(index[hash], current, 4) == 0) {
+                buffer.push_back(static_cast<unsigned char>(opIndex | hash));
+            } else {
+                std::memcpy(index[hash], current, 4);
+                if (current[3] == previous[3]) {
+                    signed char deltaR = static_cast<signed char>(current[0] - previous[0]);
+                    signed char deltaG = static_cast<signed char>(current[1] - previous[1]);
+                    signed char deltaB = static_cast<signed char>(current[2] - previous[2]);
+                    signed char deltaRG = static_cast<signed char>(deltaR - deltaG);
+                    signed char deltaBG = static_cast<signed char>(deltaB - deltaG);
+                    if (deltaR > -3 && deltaR < 2 && deltaG > -3 && deltaG < 2 && deltaB > -3 && deltaB < 2) {
+                        buffer.push_back(
+                            static_cast<unsigned char>(opDiff | (deltaR + 2) << 4 | (deltaG + 2) << 2 | (deltaB + 2)));
+                    } else if (deltaRG > -9 && deltaRG < 8 && deltaG > -33 && deltaG < 32 && deltaBG > -9 &&
+                               deltaBG < 8) {
+                        buffer.push_back(static_cast<unsigned char>(opLuma | (deltaG + 32)));
+                        buffer.push_back(static_cast<unsigned char>((deltaRG + 8) << 4 | (deltaBG + 8)));
+                    } else {
+                        buffer.push_back(opRGB);
+                        buffer.insert(buffer.end(), current, current + 3);
+                    }
+                } else {
+                    buffer.push_back(opRGBA);
+                    buffer.insert(buffer.end(), current, current + 4);
+                }
+            }
+            std::memcpy(previous, current, 4);
+        }
+    }
+    buffer.insert(buffer.end(), endMarker, endMarker + 8);
+    std::fwrite(buffer.data(), 1, buffer.size(), output);
+}
+
+// Raw RGBA: 'RGBA' magic, little-endian uint32 width and height, then top-down RGBA rows.
+void EncodeRawRGBA(ImageData &image, std::FILE *output, bool flip) {
+    std::fwrite("RGBA", 1, 4, output);
+    WriteUInt32LE(output, image.width);
+    WriteUInt32LE(output, image.height);
+    if (image.bytePerPixel == 4) {
+        for (unsigned int rowId = 0; rowId < image.height; ++rowId) {
+            std::fwrite(GetImageRow(image, rowId, flip), 1, image.width * 4, output);
+        }
+        return;
+    }
+    std::vector<unsigned char> row(image.width * 4, 0xFF);
+    for (unsigned int rowId = 0; rowId < image.height; ++rowId) {
+        const unsigned char *pixel = GetImageRow(image, rowId, flip);
+        for (unsigned int columnId = 0; columnId < image.width; ++columnId, pixel += image.bytePerPixel) {
+            std::memcpy(&row[columnId * 4], pixel, 3);
+        }
+        std::fwrite(row.data(), 1, row.size(), output);
+    }
+}
+
+// Reads an image written by EncodeRawRGBA, returns false if the file is missing or malformed.
+bool GetImageDataFromRawRGBA(const std::string &filename, ImageData &image, bool flip = false) {
+    std::FILE *inputPtr = std::fopen(filename.c_str(), "rb");
+    if (inputPtr == nullptr) {
+        return false;
+    }
+    unsigned char header[12];
+    if (std::fread(header, 1, 12, inputPtr) != 12 || std::memcmp(header, "RGBA", 4) != 0) {
+        std::fclose(inputPtr);
+        return false;
+    }
+    image.width = header[4] | header[5] << 8 | header[6] << 16 | static_cast<unsigned int>(header[7]) << 24;
+    image.height = header[8] | header[9] << 8 | header[10] << 16 | static_cast<unsigned int>(header[11]) << 24;
+    image.bytePerPixel = 4;
+    image.upscaleRGBA = false;
+    size_t rowSize = static_cast<size_t>(image.width) * 4;
+    image.data = new unsigned char[rowSize * image.height];
+    for (unsigned int rowId = 0; rowId < image.height; ++rowId) {
+        unsigned int targetRow = flip ? image.height - 1 - rowId : rowId;
+        if (std::fread(&image.data[targetRow * rowSize], 1, rowSize, inputPtr) != rowSize) {
+            delete[] image.data;
+            std::fclose(inputPtr);
+            return false;
+        }
+    }
+    std::fclose(inputPtr);
+    return true;
+}
+
+// Binary PPM (P6), alpha is dropped.
+void EncodePPM(ImageData &image, std::FILE *output, bool flip) {
+    std::fprintf(output, "P6\n%u %u\n255\n", image.width, image.height);
+    if (image.bytePerPixel == 3) {
+        for (unsigned int rowId = 0; rowId < image.height; ++rowId) {
+            std::fwrite(GetImageRow(image, rowId, flip), 1, image.width * 3, output);
+        }
+        return;
+    }
+    std::vector<unsigned char> row(image.width * 3);
+    for (unsigned int rowId = 0; rowId < image.height; ++rowId) {
+        const unsigned char *pixel = GetImageRow(image, rowId, flip);
+        for (unsigned int columnId = 0; columnId < image.width; ++columnId, pixel += image.bytePerPixel) {
+            std::memcpy(&row[columnId * 3], pixel, 3);
+        }
+        std::fwrite(row.data(), 1, row.size(), output);
+    }
+}
+
+#ifdef WITH_WEBP
+// WebP, lossy with webpQuality= or lossless with webpLossless=1. Alpha is kept for RGBA images.
+void EncodeWebP(ImageData &image, std::FILE *output, bool flip) {
+    int stride = image.width * image.bytePerPixel;
+    std::vector<unsigned char> rows;
+    const unsigned char *pixels = image.data;
+    if (flip) {
+        rows.resize(static_cast<size_t>(stride) * image.height);
+        for (unsigned int rowId = 0; rowId < image.height; ++rowId) {
+            std::memcpy(&rows[static_cast<size_t>(rowId) * stride], GetImageRow(image, rowId, flip), stride);
+        }
+        pixels = rows.data();
+    }
+    uint8_t *encoded = nullptr;
+    size_t size;
+    if (Global::webpLossless) {
+        size = image.bytePerPixel == 4 ? WebPEncodeLosslessRGBA(pixels, image.width, image.height, stride, &encoded)
+                                       : WebPEncodeLosslessRGB(pixels, image.width, image.height, stride, &encoded);
+    } else {
+        size = image.bytePerPixel == 4
+                   ? WebPEncodeRGBA(pixels, image.width, image.height, stride, Global::webpQuality, &encoded)
+                   : WebPEncodeRGB(pixels, image.width, image.height, stride, Global::webpQuality, &encoded);
+    }
+    if (size == 0) {
+        std::cerr << "ERROR: WebP encoding failed!" << std::endl;
+        exit(-1);
+    }
+    std::fwrite(encoded, 1, size, output);
+    WebPFree(encoded);
+}
+#endif
+
+std::map<std::string, ImageEncoder> &GetImageEncoders() {
+    static std::map<std::string, ImageEncoder> encoders = {
+        {"png", {"png", ".png", EncodePNG}},
+        {"qoi", {"qoi", ".qoi", EncodeQOI}},
+        {"rgba", {"rgba", ".rgba", EncodeRawRGBA}},
+        {"ppm", {"ppm", ".ppm", EncodePPM}},
+#ifdef WITH_WEBP
+        {"webp", {"webp", ".webp", EncodeWebP}},
+#endif
+    };
+    return encoders;
+}
+
+void RegisterImageEncoder(const ImageEncoder &encoder) { GetImageEncoders()[encoder.name] = encoder; }
+
+const ImageEncoder &GetImageEncoder(const std::string &name) {
+    auto &encoders = GetImageEncoders();
+    auto iterator = encoders.find(name);
+    if (iterator == encoders.end()) {
+        std::cerr << "ERROR: Unknown output format \'" << name << "\', available formats are:";
+        for (auto &encoder : encoders) {
+            std::cerr << ' ' << encoder.first;
+        }
+        std::cerr << std::endl;
+        exit(-1);
+    }
+    return iterator->second;
+}
+
+void WriteImageData(ImageData &image, const std::string &format, const std::string &filename, bool flip = false) {
+    const ImageEncoder &encoder = GetImageEncoder(format);
+    std::FILE *outputPtr = std::fopen(filename.c_str(), "wb");
+    if (outputPtr == nullptr) {
+        std::cerr << "ERROR: Unable to open output file \'" << filename << "\'" << std::endl;
+        exit(-1);
+    }
+    encoder.encode(image, outputPtr, flip);
+    std::fclose(outputPtr);
+}
+
+// Encodes the image with every registered encoder into a temporary file and reports latency and size.
+void BenchmarkImageEncoders(ImageData &image, bool flip, unsigned int iterations = 10) {
+    std::cout << "BENCHMARK: encoding " << image.width << '*' << image.height << '*' << image.bytePerPixel
+              << " image, " << iterations << " iterations" << std::endl;
+    for (auto &entry : GetImageEncoders()) {
+        const ImageEncoder &encoder = entry.second;
+        long size = 0;
+        auto begin = std::chrono::steady_clock::now();
+        for (unsigned int iteration = 0; iteration < iterations; ++iteration) {
+            std::FILE *outputPtr = std::tmpfile();
+            if (outputPtr == nullptr) {
+                std::cerr << "ERROR: Unable to create temporary file for benchmark" << std::endl;
+                exit(-1);
+            }
+            encoder.encode(image, outputPtr, flip);
+            std::fflush(outputPtr);
+            size = std::ftell(outputPtr);
+            std::fclose(outputPtr);
+        }
+        auto end = std::chrono::steady_clock::now();
+        double milliseconds = std::chrono::duration<double, std::milli>(end - begin).count() / iterations;
+        std::cout << "BENCHMARK: " << std::setw(6) << std::left << encoder.name << std::right << std::setw(10)
+                  << std::fixed << std::setprecision(3) << milliseconds << " ms " << std::setw(10) << size
+                  << " bytes" << std::endl;
+    }
+}
@@ -0,0 +1,332 @@
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// A small frame graph: passes declare which transient render targets they read, write and fully overwrite. Compiling
+// culls passes whose results are never consumed (or are overwritten before being read), orders the remaining passes
+// so consecutive passes share framebuffers, and maps targets with disjoint lifetimes onto the same pooled storage.
+
+struct FrameResourceDesc {
+    GLsizei width;
+    GLsizei height;
+    GLenum format;
+    GLsizei samples;
+
+    bool operator<(const FrameResourceDesc &other) const {
+        return std::tie(width, height, format, samples) <
+               std::tie(other.width, other.height, other.format, other.samples);
+    }
+    bool operator==(const FrameResourceDesc &other) const { return !(*this < other) && !(other < *this); }
+};
+
+struct FramePass {
+    std::string name;
+    std::string colorAttachment;
+    std::string depthAttachment;
+    std::vector<std::string> reads;
+    std::vector<std::string> writes;
+    std::vector<std::string> overwrites;  // written completely, previous content is irrelevant
+    bool sideEffect = false;              // e.g. readback, never culled
+    std::function<void()> execute;
+};
+
+struct FrameGraph {
+    std::map<std::string, FrameResourceDesc> resources;
+    std::vector<FramePass> passes;
+
+    std::vector<size_t> order;
+    std::map<std::string, GLuint> renderbuffers;
+};
+
+struct PooledRenderbuffer {
+    FrameResourceDesc desc;
+    GLuint handle;
+    bool inUse;
+    unsigned long long lastUse;  // pool clock at the last acquire
+};
+
+// Render targets outlive the graphs using them: renderbuffers are keyed by their description and framebuffers by the
+// renderbuffers they attach, so a graph with the sizes of an earlier one only clears. Idle targets are evicted least
+// recently used first once the pool holds more than Global::renderTargetBudget MiB.
+struct RenderTargetPool {
+    std::vector<PooledRenderbuffer> renderbuffers;
+    std::map<std::pair<GLuint, GLuint>, GLuint> framebuffers;  // (color, depth) renderbuffers -> framebuffer
+    unsigned long long clock = 0;
+};
+
+RenderTargetPool &GetRenderTargetPool() {
+    static RenderTargetPool pool;
+    return pool;
+}
+
+inline bool IsDepthFormat(GLenum format) {
+    return format == GL_DEPTH_COMPONENT || format == GL_DEPTH_COMPONENT16 || format == GL_DEPTH_COMPONENT24 ||
+           format == GL_DEPTH_COMPONENT32F || format == GL_DEPTH24_STENCIL8;
+}
+
+size_t GetRenderbufferBytes(const FrameResourceDesc &desc) {
+    size_t bytePerPixel = 4;
+    if (desc.format == GL_RGB8) bytePerPixel = 3;
+    if (desc.format == GL_DEPTH_COMPONENT16) bytePerPixel = 2;
+    if (desc.format == GL_RGBA16F) bytePerPixel = 8;
+    if (desc.format == GL_RGBA32F) bytePerPixel = 16;
+    return static_cast<size_t>(desc.width) * desc.height * bytePerPixel * std::max<GLsizei>(desc.samples, 1);
+}
+
+void TrimRenderTargetPool() {
+    RenderTargetPool &pool = GetRenderTargetPool();
+    size_t budget = static_cast<size_t>(Global::renderTargetBudget) << 20;
+    size_t total = 0;
+    for (auto &entry : pool.renderbuffers) {
+        total += GetRenderbufferBytes(entry.desc);
+    }
+    while (total > budget) {
+        auto victim = pool.renderbuffers.end();
+        for (auto entry = pool.renderbuffers.begin(); entry != pool.renderbuffers.end(); ++entry) {
+            if (!entry->inUse && (victim == pool.renderbuffers.end() || entry->lastUse < victim->lastUse)) {
+                victim = entry;
+            }
+        }
+        if (victim == pool.renderbuffers.end()) break;  // everything left is in use
+        for (auto framebuffer = pool.framebuffers.begin(); framebuffer != pool.framebuffers.end();) {
+            if (framebuffer->first.first == victim->handle || framebuffer->first.second == victim->handle) {
+                glDeleteFramebuffers(1, &framebuffer->second);
+                framebuffer = pool.framebuffers.erase(framebuffer);
+            } else {
+                ++framebuffer;
+            }
+        }
+        std::cout << "INFO: render target pool evicts " << victim->desc.width << '*' << victim->desc.height
+                  << (IsDepthFormat(victim->desc.format) ? " depth" : " color") << " target" << std::endl;
+        total -= GetRenderbufferBytes(victim->desc);
+        glDeleteRenderbuffers(1, &victim->handle);
+        pool.renderbuffers.erase(victim);
+    }
+}
+
+GLuint AcquireRenderbuffer(const FrameResourceDesc &desc) {
+    RenderTargetPool &pool = GetRenderTargetPool();
+    for (auto &entry : pool.renderbuffers) {
+        if (!entry.inUse && entry.desc == desc) {
+            std::cout << "INFO: render target pool reuses " << desc.width << '*' << desc.height
+                      << (IsDepthFormat(desc.format) ? " depth" : " color") << " target" << std::endl;
+            entry.inUse = true;
+            entry.lastUse = ++pool.clock;
+            return entry.handle;
+        }
+    }
+    PooledRenderbuffer entry;
+    entry.desc = desc;
+    entry.inUse = true;
+    entry.lastUse = ++pool.clock;
+    glGenRenderbuffers(1, &entry.handle);
+    glBindRenderbuffer(GL_RENDERBUFFER, entry.handle);
+    if (desc.samples > 0) {
+        glRenderbufferStorageMultisample(GL_RENDERBUFFER, desc.samples, desc.format, desc.width, desc.height);
+    } else {
+        glRenderbufferStorage(GL_RENDERBUFFER, desc.format, desc.width, desc.height);
+    }
+    pool.renderbuffers.push_back(entry);
+    return entry.handle;
+}
+
+void ReleaseRenderbuffer(GLuint handle) {
+    for (auto &entry : GetRenderTargetPool().renderbuffers) {
+        if (entry.handle == handle) entry.inUse = false;
+    }
+}
+
+void DestroyRenderTargetPool() {
+    RenderTargetPool &pool = GetRenderTargetPool();
+    for (auto &entry : pool.framebuffers) {
+        glDeleteFramebuffers(1, &entry.second);
+    }
+    for (auto &entry : pool.renderbuffers) {
+        glDeleteRenderbuffers(1, &entry.handle);
+    }
+    pool.framebuffers.clear();
+    pool.renderbuffers.clear();
+}
+
+void DeclareFrameResource(FrameGraph &graph, const std::string &name, const FrameResourceDesc &desc) {
+    graph.resources[name] = desc;
+}
+
+void AddFramePass(FrameGraph &graph, const FramePass &pass) { graph.passes.push_back(pass); }
+
+void CompileFrameGraph(FrameGraph &graph) {
+    // cull: walk backwards keeping only passes whose writes are still needed by a later pass
+    std::vector<bool> kept(graph.passes.size(), false);
+    std::set<std::string> needed;
+    for (size_t index = graph.passes.size(); index-- > 0;) {
+        const FramePass &pass = graph.passes[index];
+        bool isNeeded = pass.sideEffect;
+        for (auto &resource : pass.writes) {
+            isNeeded = isNeeded || needed.count(resource) != 0;
+        }
+        if (!isNeeded) {
+            std::cout << "INFO: frame graph culled pass \'" << pass.name << '\'' << std::endl;
+            continue;
+        }
+        kept[index] = true;
+        for (auto &resource : pass.overwrites) {
+            needed.erase(resource);
+        }
+        for (auto &resource : pass.reads) {
+            needed.insert(resource);
+        }
+    }
+
+    // order: a pass depends on every earlier kept pass touching a resource it writes, or writing one it reads
+    auto touches = [](const FramePass &pass, const std::string &resource, bool writesOnly) {
+        bool writes = std::find(pass.writes.begin(), pass.writes.end(), resource) != pass.writes.end();
+        bool reads = std::find(pass.reads.begin(), pass.reads.end(), resource) != pass.reads.end();
+        return writesOnly ? writes : writes || reads;
+    };
+    std::vector<std::set<size_t>> dependencies(graph.passes.size());
+    for (size_t later = 0; later < graph.passes.size(); ++later) {
+        if (!kept[later]) continue;
+        for (size_t earlier = 0; earlier < later; ++earlier) {
+            if (!kept[earlier]) continue;
+            for (auto &resource : graph.passes[later].writes) {
+                if (touches(graph.passes[earlier], resource, false)) dependencies[later].insert(earlier);
+            }
+            for (auto &resource : graph.passes[later].reads) {
+                if (touches(graph.passes[earlier], resource, true)) dependencies[later].insert(earlier);
+            }
+        }
+    }
+    graph.order.clear();
+    std::vector<bool> scheduled(graph.passes.size(), false);
+    size_t keptCount = std::count(kept.begin(), kept.end(), true);
+    while (graph.order.size() < keptCount) {
+        size_t choice = graph.passes.size();
+        for (size_t index = 0; index < graph.passes.size(); ++index) {
+            if (!kept[index] || scheduled[index]) continue;
+            bool ready = true;
+            for (size_t dependency : dependencies[index]) {
+                ready = ready && scheduled[dependency];
+            }
+            if (!ready) continue;
+            if (choice == graph.passes.size()) choice = index;
+            // prefer staying on the current framebuffer to avoid rebinding
+            if (!graph.order.empty()) {
+                const FramePass &last = graph.passes[graph.order.back()];
+                const FramePass &candidate = graph.passes[index];
+                if (candidate.colorAttachment == last.colorAttachment &&
+                    candidate.depthAttachment == last.depthAttachment) {
+                    choice = index;
+                    break;
+                }
+            }
+        }
+        scheduled[choice] = true;
+        graph.order.push_back(choice);
+    }
+
+    // lifetimes and aliasing: targets of equal description whose lifetimes do not overlap share storage
+    std::map<std::string, std::pair<size_t, size_t>> lifetimes;
+    for (size_t position = 0; position < graph.order.size(); ++position) {
+        const FramePass &pass = graph.passes[graph.order[position]];
+        std::vector<std::string> used(pass.reads);
+        used.insert(used.end(), pass.writes.begin(), pass.writes.end());
+        if (!pass.colorAttachment.empty()) used.push_back(pass.colorAttachment);
+        if (!pass.depthAttachment.empty()) used.push_back(pass.depthAttachment);
+        for (auto &resource : used) {
+            if (lifetimes.find(resource) == lifetimes.end()) {
+                lifetimes[resource] = std::make_pair(position, position);
+            }
+            lifetimes[resource].second = position;
+        }
+    }
+    std::vector<std::pair<std::string, std::pair<size_t, size_t>>> byFirstUse(lifetimes.begin(), lifetimes.end());
+    std::sort(byFirstUse.begin(), byFirstUse.end(),
+              [](const std::pair<std::string, std::pair<size_t, size_t>> &left,
+                 const std::pair<std::string, std::pair<size_t, size_t>> &right) {
+                  return left.second.first < right.second.first;
+              });
+    struct PhysicalTarget {
+        FrameResourceDesc desc;
+        GLuint handle;
+        size_t lastUse;
+    };
+    std::vector<PhysicalTarget> targets;
+    for (auto &entry : byFirstUse) {
+        auto resource = graph.resources.find(entry.first);
+        if (resource == graph.resources.end()) {
+            std::cerr << "ERROR: frame graph resource \'" << entry.first << "\' is not declared" << std::endl;
+            exit(-1);
+        }
+        PhysicalTarget *target = nullptr;
+        for (auto &candidate : targets) {
+            if (candidate.desc == resource->second && candidate.lastUse < entry.second.first) {
+                target = &candidate;
+                break;
+            }
+        }
+        if (target == nullptr) {
+            targets.push_back(PhysicalTarget{resource->second, AcquireRenderbuffer(resource->second), 0});
+            target = &targets.back();
+        } else {
+            std::cout << "INFO: frame graph aliases \'" << entry.first << '\'' << std::endl;
+        }
+        target->lastUse = entry.second.second;
+        graph.renderbuffers[entry.first] = target->handle;
+    }
+}
+
+GLuint GetFrameGraphFramebuffer(FrameGraph &graph, const std::string &color, const std::string &depth) {
+    GLuint colorHandle = color.empty() ? 0 : graph.renderbuffers[color];
+    GLuint depthHandle = depth.empty() ? 0 : graph.renderbuffers[depth];
+    auto key = std::make_pair(colorHandle, depthHandle);
+    auto &framebuffers = GetRenderTargetPool().framebuffers;
+    auto iterator = framebuffers.find(key);
+    if (iterator != framebuffers.end()) return iterator->second;
+    GLuint framebufferHandle;
+    glGenFramebuffers(1, &framebufferHandle);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebufferHandle);
+    if (colorHandle != 0) {
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorHandle);
+    }
+    if (depthHandle != 0) {
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthHandle);
+    }
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        std::cerr << "ERROR: frame graph framebuffer is incomplete!" << std::endl;
+        exit(-1);
+    }
+    framebuffers[key] = framebufferHandle;
+    return framebufferHandle;
+}
+
+void ExecuteFrameGraph(FrameGraph &graph) {
+    GLuint boundFramebuffer = 0;
+    bool anyBound = false;
+    for (size_t index : graph.order) {
+        const FramePass &pass = graph.passes[index];
+        if (!pass.colorAttachment.empty() || !pass.depthAttachment.empty()) {
+            GLuint framebufferHandle = GetFrameGraphFramebuffer(graph, pass.colorAttachment, pass.depthAttachment);
+            if (!anyBound || framebufferHandle != boundFramebuffer) {
+                glBindFramebuffer(GL_FRAMEBUFFER, framebufferHandle);
+                boundFramebuffer = framebufferHandle;
+                anyBound = true;
+            }
+        }
+        pass.execute();
+    }
+}
+
+void ReleaseFrameGraph(FrameGraph &graph) {
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    std::set<GLuint> released;
+    for (auto &entry : graph.renderbuffers) {
+        if (released.insert(entry.second).second) ReleaseRenderbuffer(entry.second);
+    }
+    graph.renderbuffers.clear();
+    TrimRenderTargetPool();
+}
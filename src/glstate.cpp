@@ -0,0 +1,122 @@
+#include <algorithm>
+#include <map>
+
+// Mirror of the GL state the model and background passes switch between: program, vertex array, the textures on unit
+// 0, depth/cull/blend enables, depth function and mask, culled and front face and blend functions. Changes go through
+// the functions below, which skip the GL call when the state is already set. Objects are deleted through them as well,
+// GL unbinds a deleted object and may hand out its name again.
+
+const GLuint unknownGLObject = ~0u;
+
+struct GLStateCache {
+    GLuint program = unknownGLObject;
+    GLuint vertexArray = unknownGLObject;
+    std::map<GLenum, GLuint> textures;  // target -> texture on unit 0
+    std::map<GLenum, bool> capabilities;
+    GLenum depthFunc = GL_LESS;
+    GLboolean depthMask = GL_TRUE;
+    GLenum frontFace = GL_CCW;
+    GLenum cullFace = GL_BACK;
+    GLenum blendFuncs[4] = {GL_ONE, GL_ZERO, GL_ONE, GL_ZERO};  // source/destination color, source/destination alpha
+    bool textureUnitSelected = false;
+};
+
+GLStateCache &GetGLStateCache() {
+    static GLStateCache cache;
+    return cache;
+}
+
+void UseProgram(GLuint program) {
+    GLStateCache &cache = GetGLStateCache();
+    if (cache.program == program) return;
+    glUseProgram(program);
+    cache.program = program;
+}
+
+void BindVertexArray(GLuint vertexArray) {
+    GLStateCache &cache = GetGLStateCache();
+    if (cache.vertexArray == vertexArray) return;
+    glBindVertexArray(vertexArray);
+    cache.vertexArray = vertexArray;
+}
+
+// Every texture lives on unit 0.
+void BindTexture(GLenum target, GLuint texture) {
+    GLStateCache &cache = GetGLStateCache();
+    if (!cache.textureUnitSelected) {
+        glActiveTexture(GL_TEXTURE0);
+        cache.textureUnitSelected = true;
+    }
+    auto iterator = cache.textures.find(target);
+    if (iterator != cache.textures.end() && iterator->second == texture) return;
+    glBindTexture(target, texture);
+    cache.textures[target] = texture;
+}
+
+void SetCapability(GLenum capability, bool enabled) {
+    GLStateCache &cache = GetGLStateCache();
+    auto iterator = cache.capabilities.find(capability);
+    if (iterator != cache.capabilities.end() && iterator->second == enabled) return;
+    if (enabled) {
+        glEnable(capability);
+    } else {
+        glDisable(capability);
+    }
+    cache.capabilities[capability] = enabled;
+}
+
+void SetDepthFunc(GLenum depthFunc) {
+    GLStateCache &cache = GetGLStateCache();
+    if (cache.depthFunc == depthFunc) return;
+    glDepthFunc(depthFunc);
+    cache.depthFunc = depthFunc;
+}
+
+void SetDepthMask(GLboolean depthMask) {
+    GLStateCache &cache = GetGLStateCache();
+    if (cache.depthMask == depthMask) return;
+    glDepthMask(depthMask);
+    cache.depthMask = depthMask;
+}
+
+void SetFrontFace(GLenum frontFace) {
+    GLStateCache &cache = GetGLStateCache();
+    if (cache.frontFace == frontFace) return;
+    glFrontFace(frontFace);
+    cache.frontFace = frontFace;
+}
+
+void SetCullFace(GLenum cullFace) {
+    GLStateCache &cache = GetGLStateCache();
+    if (cache.cullFace == cullFace) return;
+    glCullFace(cullFace);
+    cache.cullFace = cullFace;
+}
+
+void SetBlendFuncSeparate(GLenum sourceColor, GLenum destinationColor, GLenum sourceAlpha, GLenum destinationAlpha) {
+    GLStateCache &cache = GetGLStateCache();
+    GLenum blendFuncs[4] = {sourceColor, destinationColor, sourceAlpha, destinationAlpha};
+    if (std::equal(blendFuncs, blendFuncs + 4, cache.blendFuncs)) return;
+    glBlendFuncSeparate(sourceColor, destinationColor, sourceAlpha, destinationAlpha);
+    std::copy(blendFuncs, blendFuncs + 4, cache.blendFuncs);
+}
+
+void DeleteProgram(GLuint program) {
+    GLStateCache &cache = GetGLStateCache();
+    // a deleted program stays in use until another one is, but its name must not be trusted afterwards
+    if (cache.program == program) cache.program = unknownGLObject;
+    glDeleteProgram(program);
+}
+
+void DeleteVertexArray(GLuint vertexArray) {
+    GLStateCache &cache = GetGLStateCache();
+    if (cache.vertexArray == vertexArray) cache.vertexArray = 0;
+    glDeleteVertexArrays(1, &vertexArray);
+}
+
+void DeleteTexture(GLuint texture) {
+    for (auto &entry : GetGLStateCache().textures) {
+        if (entry.second == texture) entry.second = 0;
+    }
+    glDeleteTextures(1, &texture);
+}
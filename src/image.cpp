@@ -5,7 +5,9 @@
 #include <iostream>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <memory>
+#include <vector>
 
 struct ImageData {
     unsigned char *data;
@@ -139,13 +141,7 @@ ImageData GetImageDataFromPNG(std::string filename, unsigned int signatureLength
     return ret;
 }
 
-void WriteImageDataToPNG(ImageData &image, const std::string &filename, bool flip = false) {
-    FILE *outputPtr = std::fopen(filename.c_str(), "wb");
-    if (outputPtr == nullptr) {
-        std::cerr << "ERROR: Unable to open output file \'" << filename << "\'" << std::endl;
-        exit(-1);
-    }
-
+void WriteImageDataToPNG(ImageData &image, std::FILE *outputPtr, bool flip = false) {
     auto pngPtr = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
     if (pngPtr == nullptr) {
         std::cerr << "ERROR: \'png_create_write_struct\' failed!" << std::endl;
@@ -168,32 +164,253 @@ void WriteImageDataToPNG(ImageData &image, const std::string &filename, bool fli
 
     png_init_io(pngPtr, outputPtr);
 
-    png_set_IHDR(pngPtr, pngInfoPtr, image.width, image.height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+    png_set_IHDR(pngPtr, pngInfoPtr, image.width, image.height, 8,
+                 image.bytePerPixel == 4 ? PNG_COLOR_TYPE_RGBA : PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
                  PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
     png_color_8 bitSig;
     bitSig.red = 8;
     bitSig.green = 8;
     bitSig.blue = 8;
+    bitSig.alpha = image.bytePerPixel == 4 ? 8 : 0;
     png_set_sBIT(pngPtr, pngInfoPtr, &bitSig);
 
     png_write_info(pngPtr, pngInfoPtr);
     unsigned char **rowPtr = new unsigned char *[image.height];
+    size_t rowSize = static_cast<size_t>(image.width) * image.bytePerPixel;
     if (flip) {
         for (unsigned int rowId = 0; rowId < image.height; ++rowId) {
-            rowPtr[rowId] = &image.data[(image.height - 1 - rowId) * image.width * image.bytePerPixel];
+            rowPtr[rowId] = &image.data[(image.height - 1 - rowId) * rowSize];
         }
     } else {
         for (unsigned int rowId = 0; rowId < image.height; ++rowId) {
-            rowPtr[rowId] = &image.data[rowId * image.width * image.bytePerPixel];
+            rowPtr[rowId] = &image.data[rowId * rowSize];
         }
     }
     png_write_image(pngPtr, rowPtr);
     delete[] rowPtr;
     png_write_end(pngPtr, pngInfoPtr);
     png_destroy_write_struct(&pngPtr, &pngInfoPtr);
+}
+
+void WriteImageDataToPNG(ImageData &image, const std::string &filename, bool flip = false) {
+    FILE *outputPtr = std::fopen(filename.c_str(), "wb");
+    if (outputPtr == nullptr) {
+        std::cerr << "ERROR: Unable to open output file \'" << filename << "\'" << std::endl;
+        exit(-1);
+    }
+    WriteImageDataToPNG(image, outputPtr, flip);
     fclose(outputPtr);
 }
 
+// Row by row PNG output for frames that never exist in memory as a whole. Rows are passed top-down.
+struct PNGRowWriter {
+    std::FILE *output;
+    png_structp pngPtr;
+    png_infop pngInfoPtr;
+    unsigned int height;
+    unsigned int rowsWritten;
+};
+
+PNGRowWriter BeginPNGRows(const std::string &filename, unsigned int width, unsigned int height,
+                          unsigned int bytePerPixel) {
+    PNGRowWriter writer;
+    writer.height = height;
+    writer.rowsWritten = 0;
+    writer.output = std::fopen(filename.c_str(), "wb");
+    if (writer.output == nullptr) {
+        std::cerr << "ERROR: Unable to open output file \'" << filename << "\'" << std::endl;
+        exit(-1);
+    }
+    writer.pngPtr = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    if (writer.pngPtr == nullptr) {
+        std::cerr << "ERROR: \'png_create_write_struct\' failed!" << std::endl;
+        std::fclose(writer.output);
+        exit(-1);
+    }
+    writer.pngInfoPtr = png_create_info_struct(writer.pngPtr);
+    if (writer.pngInfoPtr == nullptr) {
+        std::cerr << "ERROR: \'png_create_info_struct\' failed!" << std::endl;
+        std::fclose(writer.output);
+        exit(-1);
+    }
+    if (setjmp(png_jmpbuf(writer.pngPtr))) {
+        std::cerr << "ERROR: Unhandled unknown libpng error" << std::endl;
+        std::fclose(writer.output);
+        png_destroy_write_struct(&writer.pngPtr, &writer.pngInfoPtr);
+        exit(-1);
+    }
+    png_init_io(writer.pngPtr, writer.output);
+    png_set_IHDR(writer.pngPtr, writer.pngInfoPtr, width, height, 8,
+                 bytePerPixel == 4 ? PNG_COLOR_TYPE_RGBA : PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+    png_color_8 bitSig;
+    bitSig.red = 8;
+    bitSig.green = 8;
+    bitSig.blue = 8;
+    bitSig.alpha = bytePerPixel == 4 ? 8 : 0;
+    png_set_sBIT(writer.pngPtr, writer.pngInfoPtr, &bitSig);
+    png_write_info(writer.pngPtr, writer.pngInfoPtr);
+    return writer;
+}
+
+void WritePNGRow(PNGRowWriter &writer, const unsigned char *row) {
+    if (setjmp(png_jmpbuf(writer.pngPtr))) {
+        std::cerr << "ERROR: Unhandled unknown libpng error" << std::endl;
+        std::fclose(writer.output);
+        png_destroy_write_struct(&writer.pngPtr, &writer.pngInfoPtr);
+        exit(-1);
+    }
+    png_write_row(writer.pngPtr, row);
+    ++writer.rowsWritten;
+}
+
+void FinishPNGRows(PNGRowWriter &writer) {
+    if (writer.rowsWritten != writer.height) {
+        std::cerr << "ERROR: PNG row writer got " << writer.rowsWritten << " of " << writer.height << " rows"
+                  << std::endl;
+        exit(-1);
+    }
+    if (setjmp(png_jmpbuf(writer.pngPtr))) {
+        std::cerr << "ERROR: Unhandled unknown libpng error" << std::endl;
+        std::fclose(writer.output);
+        png_destroy_write_struct(&writer.pngPtr, &writer.pngInfoPtr);
+        exit(-1);
+    }
+    png_write_end(writer.pngPtr, writer.pngInfoPtr);
+    png_destroy_write_struct(&writer.pngPtr, &writer.pngInfoPtr);
+    std::fclose(writer.output);
+}
+
+struct ColorPalette {
+    std::vector<png_color> colors;
+    std::vector<unsigned char> alpha;
+    std::vector<unsigned char> indices;
+};
+
+// Maps every pixel of the image to a palette entry. Colors are collected in an open-addressing hash set, pixels
+// sharing the same value after dropping 'dropBits' low bits per channel share an entry whose color is their average.
+// Returns false as soon as more than 256 entries would be needed.
+bool BuildColorPalette(const ImageData &image, ColorPalette &palette, unsigned int dropBits = 0) {
+    const unsigned int maxColors = 256;
+    const unsigned int tableSize = 1024;  // power of two, keeps the load factor under 1/4
+    const unsigned char channelMask = static_cast<unsigned char>(0xFF << dropBits);
+    std::vector<unsigned int> tableKeys(tableSize);
+    std::vector<int> tableEntries(tableSize, -1);
+    std::vector<unsigned long long> sums;
+    std::vector<unsigned int> counts;
+
+    size_t pixelCount = static_cast<size_t>(image.width) * image.height;
+    palette.indices.resize(pixelCount);
+    const unsigned char *pixel = image.data;
+    for (size_t pixelId = 0; pixelId < pixelCount; ++pixelId, pixel += image.bytePerPixel) {
+        unsigned int key = 0xFF000000u;
+        for (unsigned int byteIndex = 0; byteIndex < image.bytePerPixel; ++byteIndex) {
+            unsigned int shift = byteIndex * 8;
+            key = (key & ~(0xFFu << shift)) | (static_cast<unsigned int>(pixel[byteIndex] & channelMask) << shift);
+        }
+        unsigned int slot = (key * 0x9E3779B1u) >> 22;
+        while (tableEntries[slot] != -1 && tableKeys[slot] != key) {
+            slot = (slot + 1) & (tableSize - 1);
+        }
+        if (tableEntries[slot] == -1) {
+            if (counts.size() == maxColors) {
+                return false;
+            }
+            tableKeys[slot] = key;
+            tableEntries[slot] = static_cast<int>(counts.size());
+            counts.push_back(0);
+            sums.resize(sums.size() + 4, 0);
+        }
+        int entry = tableEntries[slot];
+        ++counts[entry];
+        for (unsigned int byteIndex = 0; byteIndex < image.bytePerPixel; ++byteIndex) {
+            sums[entry * 4 + byteIndex] += pixel[byteIndex];
+        }
+        palette.indices[pixelId] = static_cast<unsigned char>(entry);
+    }
+
+    palette.colors.resize(counts.size());
+    palette.alpha.assign(counts.size(), 0xFF);
+    for (size_t entry = 0; entry < counts.size(); ++entry) {
+        unsigned long long half = counts[entry] / 2;
+        palette.colors[entry].red = static_cast<png_byte>((sums[entry * 4 + 0] + half) / counts[entry]);
+        palette.colors[entry].green = static_cast<png_byte>((sums[entry * 4 + 1] + half) / counts[entry]);
+        palette.colors[entry].blue = static_cast<png_byte>((sums[entry * 4 + 2] + half) / counts[entry]);
+        if (image.bytePerPixel == 4) {
+            palette.alpha[entry] = static_cast<unsigned char>((sums[entry * 4 + 3] + half) / counts[entry]);
+        }
+    }
+    return true;
+}
+
+// Fast quantizer: drops low bits from every channel until the image fits into 256 colors.
+void QuantizeColorPalette(const ImageData &image, ColorPalette &palette) {
+    for (unsigned int dropBits = 1; dropBits < 8; ++dropBits) {
+        if (BuildColorPalette(image, palette, dropBits)) {
+            std::cout << "INFO: quantized image to " << palette.colors.size() << " colors (dropped " << dropBits
+                      << " bits per channel)" << std::endl;
+            return;
+        }
+    }
+}
+
+void WriteImageDataToPalettePNG(ImageData &image, std::FILE *outputPtr, bool flip = false, bool quantize = false) {
+    ColorPalette palette;
+    if (!BuildColorPalette(image, palette)) {
+        if (!quantize) {
+            std::cout << "INFO: image has more than 256 colors, writing truecolor png" << std::endl;
+            WriteImageDataToPNG(image, outputPtr, flip);
+            return;
+        }
+        QuantizeColorPalette(image, palette);
+    }
+    std::cout << "INFO: writing indexed png with " << palette.colors.size() << " colors" << std::endl;
+
+    auto pngPtr = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    if (pngPtr == nullptr) {
+        std::cerr << "ERROR: \'png_create_write_struct\' failed!" << std::endl;
+        std::fclose(outputPtr);
+        exit(-1);
+    }
+    auto pngInfoPtr = png_create_info_struct(pngPtr);
+    if (pngInfoPtr == nullptr) {
+        std::cerr << "ERROR: \'png_create_info_struct\' failed!" << std::endl;
+        std::fclose(outputPtr);
+        exit(-1);
+    }
+
+    if (setjmp(png_jmpbuf(pngPtr))) {
+        std::cerr << "ERROR: Unhandled unknown libpng error" << std::endl;
+        fclose(outputPtr);
+        png_destroy_write_struct(&pngPtr, &pngInfoPtr);
+        exit(-1);
+    }
+
+    png_init_io(pngPtr, outputPtr);
+
+    png_set_IHDR(pngPtr, pngInfoPtr, image.width, image.height, 8, PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+    png_set_PLTE(pngPtr, pngInfoPtr, palette.colors.data(), palette.colors.size());
+    // tRNS only needs to cover entries up to the last translucent one
+    int transparentCount = 0;
+    for (size_t entry = 0; entry < palette.alpha.size(); ++entry) {
+        if (palette.alpha[entry] != 0xFF) transparentCount = entry + 1;
+    }
+    if (transparentCount > 0) {
+        png_set_tRNS(pngPtr, pngInfoPtr, palette.alpha.data(), transparentCount, nullptr);
+    }
+    // indexed rows have no useful filter predictors
+    png_set_filter(pngPtr, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE);
+
+    png_write_info(pngPtr, pngInfoPtr);
+    for (unsigned int rowId = 0; rowId < image.height; ++rowId) {
+        unsigned int sourceRow = flip ? image.height - 1 - rowId : rowId;
+        png_write_row(pngPtr, &palette.indices[static_cast<size_t>(sourceRow) * image.width]);
+    }
+    png_write_end(pngPtr, pngInfoPtr);
+    png_destroy_write_struct(&pngPtr, &pngInfoPtr);
+}
+
 void CopyPixels(ImageData &image, unsigned int srcX, unsigned int srcY, unsigned int sizeX, unsigned int sizeY,
                 unsigned int targetX, unsigned int targetY) {
     for (unsigned int deltaY = 0; deltaY < sizeY; ++deltaY) {
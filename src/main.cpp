@@ -7,21 +7,33 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <map>
 #include <memory>
 #include <regex>
+#include <sstream>
 #include <stdexcept>
 #include <string>
 #include <thread>
 
+// Camera uniform block of the model vertex shader: view and projection matrix, std140.
+const GLuint cameraBlockBinding = 0;
+
+// A linked program with the locations of its active uniforms and attributes, looked up once after linking.
 struct PipelineInfo {
     GLuint vertexShaderHandle;
     GLuint fragmentShaderHandle;
     GLuint programHandle;
+    std::map<std::string, GLint> uniformLocations;  // arrays under their name without "[0]"
+    std::map<std::string, GLint> attributeLocations;
+    bool cameraBlock;  // bound to cameraBlockBinding, otherwise viewMatrix and projectMatrix are plain uniforms
 };
 
 namespace Global {
@@ -38,9 +50,32 @@ std::string outputFilePath;
 std::string backgroundPath;
 std::string modelPath;
 std::string modelConfigPath;
+std::string outputFormat = "png";
+std::string benchmark;
+std::string layerCachePath;
+std::string cameras;
+std::string scenePath;
+std::string texelMapCachePath;
+std::string animation;
+std::string pose;
+std::string backend = "gl";
+std::string view = "model";
 
 bool thinArm = false;
 bool keepWindow = false;
+bool transparentBackground = false;
+bool separateViews = false;
+bool paletteOutput = false;
+bool paletteQuantize = false;
+bool webpLossless = false;
+bool earlyZ = false;
+float webpQuality = 90.0f;
+float poseTime = 0.0f;
+unsigned int tileSize = 0;  // tileSize=, 0 only tiles frames beyond GL_MAX_RENDERBUFFER_SIZE
+unsigned int samples = 0;  // MSAA samples of the offscreen targets, 0 renders single sampled
+unsigned int renderTargetBudget = 256;  // MiB of render targets kept around between frame graphs
+unsigned int animationFrames = 36;
+unsigned int animationDelay = 50;  // milliseconds per frame
 
 GLFWwindow *mainWindow;
 
@@ -49,33 +84,52 @@ int windowHeight = 600;
 
 int frameWidth = 800;
 int frameHeight = 600;
+std::vector<std::pair<unsigned int, unsigned int>> outputSizes;  // sizes=, largest first
 
 const int signatureLength = 4;
 
-PipelineInfo modelPipelineInfo;
+PipelineInfo modelPipelineInfo;  // unspecialized, branches on uniforms
+std::map<std::pair<int, int>, PipelineInfo> modelPipelineVariants;
 PipelineInfo backgroundPipelineInfo;
 }  // namespace Global
 
 #include "model.cpp"
+#include "embedded.cpp"
+#include "pose.cpp"
 #include "image.cpp"
+#include "encoder.cpp"
+#include "animation.cpp"
+#include "composite.cpp"
+#include "coverage.cpp"
+#include "raster.cpp"
+#include "texelmap.cpp"
+#include "glstate.cpp"
+#include "framegraph.cpp"
 
 GLuint GetTextureFromImage(const ImageData &image) {
     GLuint textureHandle;
     glGenTextures(1, &textureHandle);
-    glBindTexture(GL_TEXTURE_2D, textureHandle);
+    BindTexture(GL_TEXTURE_2D, textureHandle);
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image.width, image.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image.data);
-    glFlush();
     return textureHandle;
 }
 
-void SaveImage() {
+// RGBA frames are model layers cleared to transparent. Multisample resolve averages edge pixels with that clear color,
+// which leaves them premultiplied; every readback of such a frame goes through here to get straight alpha back.
+void StraightenResolvedAlpha(ImageData &image) {
+    if (image.bytePerPixel == 4 && Global::samples > 0) UnpremultiplyAlpha(image);
+}
+
+ImageData ReadFrameImage(bool alpha, unsigned int width, unsigned int height) {
     ImageData image;
-    image.bytePerPixel = 3;
-    image.width = Global::frameWidth;
-    image.height = Global::frameHeight;
+    image.bytePerPixel = alpha ? 4 : 3;
+    image.width = width;
+    image.height = height;
+    image.upscaleRGBA = false;
     // get data from OpenGL
-    image.data = new unsigned char[image.height * image.width * image.bytePerPixel];
-    glReadPixels(0, 0, image.width, image.height, GL_RGB, GL_UNSIGNED_BYTE, image.data);
+    image.data = new unsigned char[static_cast<size_t>(image.height) * image.width * image.bytePerPixel];
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, image.width, image.height, alpha ? GL_RGBA : GL_RGB, GL_UNSIGNED_BYTE, image.data);
     // for (size_t i = 0; i < Global::frameWidth; ++i) {
     //     for (size_t byteId = 0; byteId < image.bytePerPixel; ++byteId) {
     //         std::cout << std::setw(2) << std::setfill('0') << std::hex
@@ -84,9 +138,120 @@ void SaveImage() {
     //     std::cout << ' ';
     // }
     // std::cout << std::endl;
-    // initialize output
-    WriteImageDataToPNG(image, Global::outputFilePath, true);
-    delete[] image.data;
+    StraightenResolvedAlpha(image);
+    return image;
+}
+
+// out.png with suffix "0" is out_0.png
+std::string GetSuffixedOutputPath(const std::string &path, const std::string &suffix) {
+    size_t extension = path.rfind('.');
+    size_t directory = path.find_last_of("/\\");
+    if (extension == std::string::npos || (directory != std::string::npos && extension < directory)) {
+        extension = path.size();
+    }
+    return path.substr(0, extension) + '_' + suffix + path.substr(extension);
+}
+
+// output=out.png with atlas=separate writes out_0.png, out_1.png, ...
+std::string GetViewOutputPath(size_t view) {
+    return GetSuffixedOutputPath(Global::outputFilePath, std::to_string(view));
+}
+
+// sizes=: the image was drawn at the largest size and every size is box filtered from it, so one draw and one readback
+// serve all of them. Sizes are scaled and encoded in parallel, one thread each, and written as out_<W>x<H>.png. An
+// atlas keeps its view count, only the cell size changes.
+void SaveImageSizes(const ImageData &image, const std::string &filename) {
+    std::vector<std::thread> workers;
+    for (auto &size : Global::outputSizes) {
+        unsigned int width = static_cast<unsigned long long>(image.width) * size.first / Global::frameWidth;
+        unsigned int height = size.second;
+        std::string path = GetSuffixedOutputPath(filename, std::to_string(size.first) + 'x' + std::to_string(height));
+        workers.emplace_back([&image, width, height, path]() {
+            ImageData scaled = image;
+            if (width != image.width || height != image.height) scaled = ResizeImage(image, width, height);
+            WriteImageData(scaled, Global::outputFormat, path, true);
+            if (scaled.data != image.data) delete[] scaled.data;
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    std::cout << "INFO: wrote " << Global::outputSizes.size() << " sizes" << std::endl;
+}
+
+void SaveImage(ImageData &image, const std::string &filename = Global::outputFilePath) {
+    if (Global::benchmark == "encoders") {
+        BenchmarkImageEncoders(image, true);
+    }
+    if (!Global::outputSizes.empty()) {
+        SaveImageSizes(image, filename);
+        return;
+    }
+    WriteImageData(image, Global::outputFormat, filename, true);
+}
+
+// Composites a model layer atlas cell by cell, so every view gets the whole background.
+ImageData ComposeViewSheet(const ImageData &atlas, size_t viewCount) {
+    if (viewCount == 1) return ComposeModelLayer(atlas);
+    unsigned int viewWidth = atlas.width / viewCount;
+    ImageData sheet;
+    sheet.data = nullptr;
+    for (size_t view = 0; view < viewCount; ++view) {
+        ImageData cell = CropImage(atlas, view * viewWidth, 0, viewWidth, atlas.height);
+        ImageData composed = ComposeModelLayer(cell);
+        delete[] cell.data;
+        if (sheet.data == nullptr) {
+            sheet = composed;
+            sheet.width = atlas.width;
+            sheet.data = new unsigned char[static_cast<size_t>(sheet.width) * sheet.height * sheet.bytePerPixel];
+        }
+        PasteImage(composed, sheet, view * viewWidth, 0);
+        delete[] composed.data;
+    }
+    return sheet;
+}
+
+// Views are rendered left to right into one frameWidth x frameHeight cell each. The atlas is saved as one sprite
+// sheet or, with atlas=separate, one image per view. A model layer atlas is composited cell by cell first.
+void SaveViews(ImageData &atlas, size_t viewCount, bool composeLayer) {
+    if (viewCount == 1 || !Global::separateViews) {
+        if (!composeLayer) {
+            SaveImage(atlas);
+            return;
+        }
+        ImageData sheet = ComposeViewSheet(atlas, viewCount);
+        SaveImage(sheet);
+        delete[] sheet.data;
+        return;
+    }
+    unsigned int viewWidth = atlas.width / viewCount;
+    for (size_t view = 0; view < viewCount; ++view) {
+        ImageData cell = CropImage(atlas, view * viewWidth, 0, viewWidth, atlas.height);
+        if (composeLayer) {
+            ImageData composed = ComposeModelLayer(cell);
+            delete[] cell.data;
+            cell = composed;
+        }
+        SaveImage(cell, GetViewOutputPath(view));
+        delete[] cell.data;
+    }
+}
+
+// Serves the request from a cached model layer, compositing the background on the CPU. Returns false on a miss.
+bool RenderFromLayerCache() {
+    ImageData layer;
+    std::string cacheFile = GetModelLayerCacheFile();
+    size_t viewCount = GetSelectedCameras(LoadSelectedModelConfig()).size();
+    if (!GetImageDataFromRawRGBA(cacheFile, layer, true) ||
+        layer.width != static_cast<unsigned int>(Global::frameWidth) * viewCount ||
+        layer.height != static_cast<unsigned int>(Global::frameHeight)) {
+        std::cout << "INFO: model layer cache miss \'" << cacheFile << '\'' << std::endl;
+        return false;
+    }
+    std::cout << "INFO: model layer cache hit \'" << cacheFile << '\'' << std::endl;
+    SaveViews(layer, viewCount, true);
+    delete[] layer.data;
+    return true;
 }
 
 void ParseArguments(int argc, char **argv) {
@@ -127,6 +292,39 @@ void ApplyArguments() {
         char *ptr;
         Global::frameHeight = strtoul(Global::arguments["frameHeight"].c_str(), &ptr, 10);
     }
+    if (Global::arguments.find("sizes") != Global::arguments.end()) {
+        // WxH,WxH,... sharing one aspect ratio; the frame is drawn at the largest
+        std::istringstream list(Global::arguments["sizes"]);
+        std::string entry;
+        while (std::getline(list, entry, ',')) {
+            unsigned int width, height;
+            if (std::sscanf(entry.c_str(), "%ux%u", &width, &height) != 2 || width == 0 || height == 0) {
+                std::cerr << "ERROR: Malformed size '" << entry << "'" << std::endl;
+                exit(-1);
+            }
+            Global::outputSizes.push_back(std::make_pair(width, height));
+        }
+        std::sort(Global::outputSizes.begin(), Global::outputSizes.end(),
+                  [](const std::pair<unsigned int, unsigned int> &left,
+                     const std::pair<unsigned int, unsigned int> &right) { return left.second > right.second; });
+        if (Global::outputSizes.empty()) {
+            std::cerr << "ERROR: sizes= needs at least one size" << std::endl;
+            exit(-1);
+        }
+        Global::frameWidth = Global::outputSizes.front().first;
+        Global::frameHeight = Global::outputSizes.front().second;
+        for (auto &size : Global::outputSizes) {
+            // allow a pixel of rounding in either direction
+            long long difference = static_cast<long long>(size.first) * Global::frameHeight -
+                                    static_cast<long long>(size.second) * Global::frameWidth;
+            if (std::llabs(difference) > std::max(Global::frameWidth, Global::frameHeight)) {
+                std::cerr << "ERROR: sizes= must share one aspect ratio, '" << size.first << 'x' << size.second
+                          << "' does not match '" << Global::frameWidth << 'x' << Global::frameHeight << "'"
+                          << std::endl;
+                exit(-1);
+            }
+        }
+    }
     if (Global::arguments.find("vertexShader") != Global::arguments.end()) {
         Global::vertexShaderPath = Global::arguments["vertexShader"];
     }
@@ -139,6 +337,21 @@ void ApplyArguments() {
     if (Global::arguments.find("output") != Global::arguments.end()) {
         Global::outputFilePath = Global::arguments["output"];
     }
+    if (Global::arguments.find("outputFormat") != Global::arguments.end()) {
+        Global::outputFormat = Global::arguments["outputFormat"];
+    }
+    if (Global::arguments.find("webpQuality") != Global::arguments.end()) {
+        char *ptr;
+        Global::webpQuality = strtof(Global::arguments["webpQuality"].c_str(), &ptr);
+    }
+    if (Global::arguments.find("webpLossless") != Global::arguments.end()) {
+        char *ptr;
+        unsigned int value = strtoul(Global::arguments["webpLossless"].c_str(), &ptr, 10);
+        Global::webpLossless = value != 0;
+    }
+    if (Global::arguments.find("benchmark") != Global::arguments.end()) {
+        Global::benchmark = Global::arguments["benchmark"];
+    }
     if (Global::arguments.find("background") != Global::arguments.end()) {
         Global::backgroundPath = Global::arguments["background"];
     }
@@ -172,6 +385,138 @@ void ApplyArguments() {
             Global::keepWindow = true;
         }
     }
+    if (Global::arguments.find("transparent") != Global::arguments.end()) {
+        char *ptr;
+        unsigned int value = strtoul(Global::arguments["transparent"].c_str(), &ptr, 10);
+        Global::transparentBackground = value != 0;
+    }
+    if (Global::arguments.find("backend") != Global::arguments.end()) {
+        Global::backend = Global::arguments["backend"];
+        if (Global::backend != "gl" && Global::backend != "cpu" && Global::backend != "isometric" &&
+            Global::backend != "texelmap") {
+            std::cerr << "ERROR: Unknown backend \'" << Global::backend << "\'" << std::endl;
+            exit(-1);
+        }
+    }
+    if (Global::arguments.find("view") != Global::arguments.end()) {
+        Global::view = Global::arguments["view"];
+        if (Global::view != "model" && Global::view != "face") {
+            std::cerr << "ERROR: Unknown view \'" << Global::view << "\'" << std::endl;
+            exit(-1);
+        }
+    }
+    if (Global::arguments.find("layerCache") != Global::arguments.end()) {
+        Global::layerCachePath = Global::arguments["layerCache"];
+        // cached layers are composited onto the built-in color or background= image, never through the GL pass
+        if (!Global::bgVertexShaderPath.empty() || !Global::bgFragmentShaderPath.empty()) {
+            std::cout << "INFO: background shaders are not used with the layer cache" << std::endl;
+        }
+    }
+    if (Global::arguments.find("cameras") != Global::arguments.end()) {
+        Global::cameras = Global::arguments["cameras"];
+    }
+    if (Global::arguments.find("atlas") != Global::arguments.end()) {
+        std::string atlas = Global::arguments["atlas"];
+        if (atlas != "sheet" && atlas != "separate") {
+            std::cerr << "ERROR: Unknown atlas mode \'" << atlas << "\'" << std::endl;
+            exit(-1);
+        }
+        Global::separateViews = atlas == "separate";
+    }
+    if (Global::arguments.find("scene") != Global::arguments.end()) {
+        Global::scenePath = Global::arguments["scene"];
+        if (Global::backend != "gl" || Global::view != "model") {
+            std::cerr << "ERROR: scene= needs backend=gl and view=model" << std::endl;
+            exit(-1);
+        }
+        if (!Global::layerCachePath.empty()) {
+            std::cout << "INFO: layer cache is not used for scenes" << std::endl;
+            Global::layerCachePath.clear();
+        }
+    }
+    if (Global::arguments.find("pose") != Global::arguments.end()) {
+        Global::pose = Global::arguments["pose"];
+    }
+    if (Global::arguments.find("poseTime") != Global::arguments.end()) {
+        char *ptr;
+        Global::poseTime = strtof(Global::arguments["poseTime"].c_str(), &ptr);
+    }
+    if (Global::arguments.find("animate") != Global::arguments.end()) {
+        // turntable|pose[:frames=N][:delay=milliseconds], pose keeps the cameras still and only plays pose=
+        std::istringstream spec(Global::arguments["animate"]);
+        std::string option;
+        std::getline(spec, Global::animation, ':');
+        if (Global::animation != "turntable" && Global::animation != "pose") {
+            std::cerr << "ERROR: Unknown animation \'" << Global::animation << "\'" << std::endl;
+            exit(-1);
+        }
+        while (std::getline(spec, option, ':')) {
+            char *ptr;
+            if (option.compare(0, 7, "frames=") == 0) {
+                Global::animationFrames = strtoul(option.c_str() + 7, &ptr, 10);
+            } else if (option.compare(0, 6, "delay=") == 0) {
+                Global::animationDelay = strtoul(option.c_str() + 6, &ptr, 10);
+            } else {
+                std::cerr << "ERROR: Unknown animation option \'" << option << "\'" << std::endl;
+                exit(-1);
+            }
+        }
+        if (Global::animationFrames == 0 || Global::animationDelay > 0xFFFF) {
+            std::cerr << "ERROR: animate= needs at least one frame and a delay below 65536ms" << std::endl;
+            exit(-1);
+        }
+        if ((Global::backend != "gl" && Global::backend != "cpu") || Global::view != "model") {
+            std::cerr << "ERROR: animate= needs backend=gl or backend=cpu and view=model" << std::endl;
+            exit(-1);
+        }
+        if (Global::outputFormat != "png" && Global::outputFormat != "gif") {
+            std::cerr << "ERROR: animate= writes outputFormat=png (APNG) or outputFormat=gif" << std::endl;
+            exit(-1);
+        }
+        if (Global::separateViews) {
+            std::cerr << "ERROR: animate= writes all views into one sprite sheet animation" << std::endl;
+            exit(-1);
+        }
+        if (!Global::outputSizes.empty()) {
+            std::cerr << "ERROR: animate= writes one size, use frameWidth= and frameHeight=" << std::endl;
+            exit(-1);
+        }
+        if (!Global::layerCachePath.empty()) {
+            std::cout << "INFO: layer cache is not used for animations" << std::endl;
+            Global::layerCachePath.clear();
+        }
+    }
+    if (Global::arguments.find("earlyZ") != Global::arguments.end()) {
+        char *ptr;
+        unsigned int value = strtoul(Global::arguments["earlyZ"].c_str(), &ptr, 10);
+        Global::earlyZ = value != 0;
+    }
+    if (Global::arguments.find("tileSize") != Global::arguments.end()) {
+        char *ptr;
+        Global::tileSize = strtoul(Global::arguments["tileSize"].c_str(), &ptr, 10);
+    }
+    if (Global::arguments.find("samples") != Global::arguments.end()) {
+        char *ptr;
+        Global::samples = strtoul(Global::arguments["samples"].c_str(), &ptr, 10);
+        if (Global::samples == 1) Global::samples = 0;
+    }
+    if (Global::arguments.find("renderTargetBudget") != Global::arguments.end()) {
+        char *ptr;
+        Global::renderTargetBudget = strtoul(Global::arguments["renderTargetBudget"].c_str(), &ptr, 10);
+    }
+    if (Global::arguments.find("texelMapCache") != Global::arguments.end()) {
+        Global::texelMapCachePath = Global::arguments["texelMapCache"];
+    }
+    if (Global::arguments.find("palette") != Global::arguments.end()) {
+        char *ptr;
+        unsigned int value = strtoul(Global::arguments["palette"].c_str(), &ptr, 10);
+        Global::paletteOutput = value != 0;
+    }
+    if (Global::arguments.find("quantize") != Global::arguments.end()) {
+        char *ptr;
+        unsigned int value = strtoul(Global::arguments["quantize"].c_str(), &ptr, 10);
+        Global::paletteQuantize = value != 0;
+    }
 }
 
 std::string GetFileContent(const std::string &filename, const std::string &reason, size_t bufferSize = 1024) {
@@ -222,7 +567,62 @@ std::string GetGLProgramLog(GLuint programHandle) {
     return infoLog;
 }
 
-PipelineInfo SynthesizePipeline(std::string vertexShaderPath, std::string fragmentShaderPath) {
+// Puts '#define NAME VALUE' lines right after the #version line, which has to stay first. #line keeps compiler
+// messages pointing at the lines of the file.
+std::string InjectShaderDefines(const std::string &source, const std::vector<std::pair<std::string, int>> &defines) {
+    if (defines.empty()) return source;
+    size_t version = source.find("#version");
+    size_t insert = version == std::string::npos ? 0 : source.find('\n', version);
+    insert = insert == std::string::npos ? source.size() : insert + 1;
+    std::ostringstream injected;
+    for (auto &define : defines) {
+        injected << "#define " << define.first << ' ' << define.second << '\n';
+    }
+    size_t line = std::count(source.begin(), source.begin() + insert, '\n') + 1;
+    injected << "#line " << line << '\n';
+    return source.substr(0, insert) + injected.str() + source.substr(insert);
+}
+
+void ReflectPipeline(PipelineInfo &info) {
+    GLint count, maxLength;
+    glGetProgramiv(info.programHandle, GL_ACTIVE_UNIFORMS, &count);
+    glGetProgramiv(info.programHandle, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+    std::vector<char> name(maxLength + 1);
+    for (GLint index = 0; index < count; ++index) {
+        GLint size;
+        GLenum type;
+        glGetActiveUniform(info.programHandle, index, name.size(), nullptr, &size, &type, name.data());
+        GLint location = glGetUniformLocation(info.programHandle, name.data());
+        // members of uniform blocks have no location
+        if (location == -1) continue;
+        std::string uniform(name.data());
+        if (uniform.size() > 3 && uniform.compare(uniform.size() - 3, 3, "[0]") == 0) {
+            uniform.resize(uniform.size() - 3);
+        }
+        info.uniformLocations[uniform] = location;
+    }
+    glGetProgramiv(info.programHandle, GL_ACTIVE_ATTRIBUTES, &count);
+    glGetProgramiv(info.programHandle, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &maxLength);
+    name.assign(maxLength + 1, '\0');
+    for (GLint index = 0; index < count; ++index) {
+        GLint size;
+        GLenum type;
+        glGetActiveAttrib(info.programHandle, index, name.size(), nullptr, &size, &type, name.data());
+        info.attributeLocations[name.data()] = glGetAttribLocation(info.programHandle, name.data());
+    }
+    GLuint blockIndex = glGetUniformBlockIndex(info.programHandle, "Camera");
+    info.cameraBlock = blockIndex != GL_INVALID_INDEX;
+    if (info.cameraBlock) glUniformBlockBinding(info.programHandle, blockIndex, cameraBlockBinding);
+}
+
+// -1 for uniforms the program does not use, which glUniform* ignores.
+GLint GetUniformLocation(const PipelineInfo &info, const std::string &name) {
+    auto iterator = info.uniformLocations.find(name);
+    return iterator == info.uniformLocations.end() ? -1 : iterator->second;
+}
+
+PipelineInfo SynthesizePipeline(std::string vertexShaderPath, std::string fragmentShaderPath,
+                                const std::vector<std::pair<std::string, int>> &fragmentDefines = {}) {
     int status;
     const char *_ref;
     PipelineInfo info;
@@ -241,7 +641,8 @@ PipelineInfo SynthesizePipeline(std::string vertexShaderPath, std::string fragme
     }
     // process fragment shader
     info.fragmentShaderHandle = glCreateShader(GL_FRAGMENT_SHADER);
-    auto fragmentShaderContent = GetFileContent(fragmentShaderPath, "fragment shader");
+    auto fragmentShaderContent =
+        InjectShaderDefines(GetFileContent(fragmentShaderPath, "fragment shader"), fragmentDefines);
     _ref = fragmentShaderContent.c_str();
     glShaderSource(info.fragmentShaderHandle, 1, &_ref, nullptr);
     glCompileShader(info.fragmentShaderHandle);
@@ -261,6 +662,7 @@ PipelineInfo SynthesizePipeline(std::string vertexShaderPath, std::string fragme
         std::cerr << GetGLProgramLog(info.programHandle) << std::endl;
         exit(-1);
     }
+    ReflectPipeline(info);
     return info;
 }
 
@@ -284,247 +686,1118 @@ void Initizalize() {
         exit(-1);
     }
 
+    if (Global::samples > 0) {
+        GLint maxSamples = 0;
+        glGetIntegerv(GL_MAX_SAMPLES, &maxSamples);
+        if (Global::samples > static_cast<unsigned int>(maxSamples)) {
+            std::cout << "INFO: samples=" << Global::samples << " exceeds GL_MAX_SAMPLES, using " << maxSamples
+                      << std::endl;
+            Global::samples = maxSamples > 1 ? maxSamples : 0;
+        }
+    }
+
     glViewport(0, 0, Global::windowWidth, Global::windowHeight);
     std::cout << "INFO: window framebuffer is " << Global::frameWidth << '*' << Global::frameHeight << std::endl;
     Global::modelPipelineInfo = SynthesizePipeline(Global::vertexShaderPath, Global::fragmentShaderPath);
-    Global::backgroundPipelineInfo = SynthesizePipeline(Global::bgVertexShaderPath, Global::bgFragmentShaderPath);
 }
 
-void RenderBackground() {
-    float vertexInfo[] = {-1.0f, -1.0f, 0.0f, 0.0f, 1.0f,  -1.0f, 1.0f, 0.0f,
-                          1.0f,  1.0f,  1.0f, 1.0f, -1.0f, 1.0f,  0.0f, 1.0f};
-    glUseProgram(Global::backgroundPipelineInfo.programHandle);
+// Compiled on first use, so model-only frames (transparent=1, layerCache=) need no background shaders.
+const PipelineInfo &GetBackgroundPipeline() {
+    if (Global::backgroundPipelineInfo.programHandle == 0) {
+        Global::backgroundPipelineInfo = SynthesizePipeline(Global::bgVertexShaderPath, Global::bgFragmentShaderPath);
+    }
+    return Global::backgroundPipelineInfo;
+}
 
+// Full screen quad of the background pipeline and, with background=, its texture. Uploaded once so that views and
+// animation frames only pay for the draw.
+struct BackgroundRenderData {
     GLuint vertexArrayHandle;
-    GLuint vertexArrayBufferHandle;
+    GLuint vertexBufferHandle;
     GLuint textureHandle;
+};
 
-    glGenVertexArrays(1, &vertexArrayHandle);
-    glGenBuffers(1, &vertexArrayBufferHandle);
+// The quad always fills the viewport, its texture coordinates select the part of the frame it shows: all of it, or
+// one tile's share with tiled rendering. Rows are bottom-up.
+void SetBackgroundRegion(const BackgroundRenderData &data, float left, float bottom, float right, float top) {
+    float vertexInfo[] = {-1.0f, -1.0f, left,  bottom, 1.0f,  -1.0f, right, bottom,
+                          1.0f,  1.0f,  right, top,    -1.0f, 1.0f,  left,  top};
+    glBindBuffer(GL_ARRAY_BUFFER, data.vertexBufferHandle);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(vertexInfo), vertexInfo, GL_DYNAMIC_DRAW);
+}
+
+BackgroundRenderData PrepareBackground() {
+    BackgroundRenderData data;
+    glGenVertexArrays(1, &data.vertexArrayHandle);
+    glGenBuffers(1, &data.vertexBufferHandle);
 
-    glBindVertexArray(vertexArrayHandle);
-    glBindBuffer(GL_ARRAY_BUFFER, vertexArrayBufferHandle);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vertexInfo), vertexInfo, GL_STATIC_DRAW);
+    BindVertexArray(data.vertexArrayHandle);
+    SetBackgroundRegion(data, 0.0f, 0.0f, 1.0f, 1.0f);
 
     glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 4, (void *)(0));
     glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 4, (void *)(sizeof(float) * 2));
     glEnableVertexAttribArray(0);
     glEnableVertexAttribArray(1);
 
+    data.textureHandle = 0;
     if (!Global::backgroundPath.empty()) {
         ImageData image = GetImageDataFromPNG(Global::backgroundPath, Global::signatureLength, true);
-        textureHandle = GetTextureFromImage(image);
+        data.textureHandle = GetTextureFromImage(image);
         delete[] image.data;
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, textureHandle);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        GLuint samplerLocation = glGetUniformLocation(Global::backgroundPipelineInfo.programHandle, "textureSampler");
-        glUniform1i(samplerLocation, 0);
     }
+    return data;
+}
 
-    glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
-    glFlush();
+// Background shaders without the backgroundDepth uniform always draw at depth 0 and cannot go behind the model.
+bool CanDrawBackgroundBehind() {
+    return GetUniformLocation(GetBackgroundPipeline(), "backgroundDepth") != -1;
+}
 
-    glDeleteBuffers(1, &vertexArrayBufferHandle);
-    glDeleteVertexArrays(1, &vertexArrayHandle);
+// With 'behind' the quad lies on the far plane and is drawn after the opaque model: the depth test rejects every
+// covered pixel before it is shaded, only the uncovered ones equal the cleared depth and pass GL_LEQUAL.
+void DrawBackground(const BackgroundRenderData &data, bool behind = false) {
+    const PipelineInfo &pipeline = GetBackgroundPipeline();
+    UseProgram(pipeline.programHandle);
+    glUniform1f(GetUniformLocation(pipeline, "backgroundDepth"), behind ? 1.0f : 0.0f);
+    SetCapability(GL_DEPTH_TEST, behind);
+    SetDepthFunc(behind ? GL_LEQUAL : GL_LESS);
+    SetDepthMask(behind ? GL_FALSE : GL_TRUE);
+    SetCapability(GL_CULL_FACE, false);
+    SetCapability(GL_BLEND, false);
+    BindVertexArray(data.vertexArrayHandle);
+    if (data.textureHandle != 0) {
+        BindTexture(GL_TEXTURE_2D, data.textureHandle);
+        glUniform1i(GetUniformLocation(pipeline, "textureSampler"), 0);
+    }
+    glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+}
 
-    if (!Global::backgroundPath.empty()) {
-        glDeleteTextures(1, &textureHandle);
+void ReleaseBackground(BackgroundRenderData &data) {
+    glDeleteBuffers(1, &data.vertexBufferHandle);
+    DeleteVertexArray(data.vertexArrayHandle);
+    if (data.textureHandle != 0) {
+        DeleteTexture(data.textureHandle);
     }
 }
 
+void RenderBackground() {
+    BackgroundRenderData data = PrepareBackground();
+    DrawBackground(data);
+    ReleaseBackground(data);
+}
+
 inline void TransformVertices(std::vector<glm::vec4> &vertices, const glm::mat4 &transformMatrix) {
     for (auto &vertex : vertices) {
         vertex = transformMatrix * vertex;
     }
 }
 
-void RenderModel(unsigned int width, unsigned int height) {
-    auto models = LoadObjModel(Global::modelPath, 64, 64);
-    auto config = LoadModelConfig(Global::modelConfigPath);
-    glm::mat4 camaraMatrix = glm::lookAt(config.eyePosition, config.eyeTarget, config.eyeUpDirection);
-    glm::mat4 projectMatrix = glm::perspective(glm::radians(60.0f), (float)(width) / (float)(height), 0.1f, 100.0f);
+glm::mat4 GetViewMatrix(const ModelConfig &config) {
+    return glm::lookAt(config.eyePosition, config.eyeTarget, config.eyeUpDirection);
+}
+
+glm::mat4 GetViewMatrix(const ModelCamera &camera) {
+    return glm::lookAt(camera.eyePosition, camera.eyeTarget, camera.eyeUpDirection);
+}
+
+glm::mat4 GetProjectMatrix(const ModelConfig &config, unsigned int width, unsigned int height) {
+    float aspect = (float)(width) / (float)(height);
+    if (config.orthographic) {
+        float halfHeight = config.orthoHeight * 0.5f;
+        return glm::ortho(-halfHeight * aspect, halfHeight * aspect, -halfHeight, halfHeight, 0.1f, 100.0f);
+    }
+    return glm::perspective(glm::radians(60.0f), aspect, 0.1f, 100.0f);
+}
+
+// Sub-frustum of 'projectMatrix' that maps the tileWidth x tileHeight pixels at (tileX, tileY) of a width x height
+// frame onto the whole viewport. Tiles may reach past the frame, those pixels are simply not used.
+glm::mat4 GetTileProjectMatrix(const glm::mat4 &projectMatrix, unsigned int width, unsigned int height, int tileX,
+                               int tileY, unsigned int tileWidth, unsigned int tileHeight) {
+    float centerX = -1.0f + (2.0f * tileX + tileWidth) / width;
+    float centerY = -1.0f + (2.0f * tileY + tileHeight) / height;
+    glm::mat4 scale = glm::scale(glm::mat4(1.0f), glm::vec3(static_cast<float>(width) / tileWidth,
+                                                            static_cast<float>(height) / tileHeight, 1.0f));
+    return scale * glm::translate(glm::mat4(1.0f), glm::vec3(-centerX, -centerY, 0.0f)) * projectMatrix;
+}
 
-    // load render data
+// Loads the input skin as it is uploaded to GL: bottom-up RGBA rows, legacy 64x32 skins extended to 64x64.
+ImageData LoadSkinImage(const std::string &filename = Global::inputFilePath) {
+    ImageData image = GetImageDataFromPNG(filename, Global::signatureLength, true);
+    if (image.width / image.height == 2) {
+        bool upscaleRGBA = image.upscaleRGBA;
+        FilpImageVertically(image);
+        ImageData newImage = ExtendSkin32x(image, Global::thinArm);
+        delete[] image.data;
+        image = newImage;
+        image.upscaleRGBA = upscaleRGBA;
+        FilpImageVertically(image);
+    }
+    return image;
+}
+
+// Per-instance vertex attributes: placement in the scene, skin layer in the texture array and the upscaleRGBA flag.
+struct ModelInstance {
+    glm::mat4 transform;
+    float skinLayer;
+    float upscaleRGBA;
+};
+
+struct ModelRenderData {
     GLuint vertexArrayHandle;
     GLuint vertexBufferHandle;
+    GLuint elementBufferHandle;
+    GLuint instanceBufferHandle;
     GLuint textureHandle;
+    GLsizei baseElementCount;
+    GLsizei attachmentElementCount;
+    GLsizei instanceCount;
+    int upscaleRGBA;                        // 0 or 1 when all instances agree, -1 when it differs between instances
+    bool specializeShaders;                 // false keeps the uniform branching program, for benchmark=shading
+    std::vector<glm::mat4> camaraMatrices;  // one per view, drawn left to right into viewWidth x viewHeight cells
+    GLsizei viewWidth;
+    GLsizei viewHeight;
+    glm::mat4 projectMatrix;
+    std::vector<glm::mat4> partMatrices;  // identity only for unpacked vertices
+    float textureScale;                   // 1/64 for packed texel coordinates
+    std::vector<PackedModelPart> parts;   // empty for unpacked vertices, which have the pose baked in
+    GLuint cameraBufferHandle;            // Camera blocks, see UploadModelCamera
+    GLsizei cameraStride;
+    ModelConfig config;
+};
 
-	bool upscaleRGBA = false;
-	
-    glGenVertexArrays(1, &vertexArrayHandle);
-    glGenBuffers(1, &vertexBufferHandle);
-
-    std::vector<float> vertexData;
-    std::vector<int> renderIndex;
-    std::vector<int> renderCount;
-    std::vector<float> attachVertexData;
-    std::vector<int> attachRenderIndex;
-    std::vector<int> attachRenderCount;
-    int faceCount = 0;
-
-    for (auto &object : models) {
-        const std::string &name = object.first;
-        if (name.find("Attachment") == std::string::npos) {
-            glm::mat4 transformMatrix = glm::translate(glm::mat4(1.0f), config.origins[name]);
-            for (auto &face : object.second.faces) {
-                for (size_t i = 0; i < 4; ++i) {
-                    glm::vec4 &raw_position = object.second.vertices[face.element[i].vertexIndex - 1];
-                    glm::vec4 position = transformMatrix * raw_position;
-                    glm::vec2 &textureCoord = object.second.textureCoords[face.element[i].textureCoordIndex - 1];
-                    vertexData.push_back(position.x);
-                    vertexData.push_back(position.y);
-                    vertexData.push_back(position.z);
-                    vertexData.push_back(position.w);
-                    vertexData.push_back(textureCoord.x);
-                    vertexData.push_back(textureCoord.y);
-                }
-                renderIndex.push_back(faceCount * 4);
-                renderCount.push_back(4);
-                ++faceCount;
-            }
+// Base faces first and attachment faces after them in the same buffers, two triangles per face in fan order.
+template <typename Vertex>
+void UploadModelVertices(ModelRenderData &data, const std::vector<Vertex> &baseVertices,
+                         const std::vector<Vertex> &attachmentVertices) {
+    std::vector<Vertex> vertices(baseVertices);
+    vertices.insert(vertices.end(), attachmentVertices.begin(), attachmentVertices.end());
+    std::vector<GLuint> elements;
+    for (GLuint faceStart = 0; faceStart + 4 <= vertices.size(); faceStart += 4) {
+        for (GLuint corner : {0, 1, 2, 0, 2, 3}) {
+            elements.push_back(faceStart + corner);
         }
     }
-    for (auto &object : models) {
-        const std::string &name = object.first;
-        if (name.find("Attachment") == std::string::npos) continue;
-        std::string refName = name.substr(0, name.find("Attachment"));
-        ObjModel &objectRef = models[refName];
-        glm::mat4 transformMatrix = glm::translate(glm::mat4(1.0f), config.origins[refName]);
-        transformMatrix =
-            glm::scale(transformMatrix, glm::vec3(config.attachmentScales[refName], config.attachmentScales[refName],
-                                                  config.attachmentScales[refName]));
-        for (auto &face : objectRef.faces) {
-            for (size_t i = 0; i < 4; ++i) {
-                glm::vec4 &raw_position = objectRef.vertices[face.element[i].vertexIndex - 1];
-                glm::vec4 position = transformMatrix * raw_position;
-                glm::vec2 &textureCoord = object.second.textureCoords[face.element[i].textureCoordIndex - 1];
-                attachVertexData.push_back(position.x);
-                attachVertexData.push_back(position.y);
-                attachVertexData.push_back(position.z);
-                attachVertexData.push_back(position.w);
-                attachVertexData.push_back(textureCoord.x);
-                attachVertexData.push_back(textureCoord.y);
-            }
-            attachRenderIndex.push_back(faceCount * 4);
-            attachRenderCount.push_back(4);
-            ++faceCount;
+    data.baseElementCount = baseVertices.size() / 4 * 6;
+    data.attachmentElementCount = attachmentVertices.size() / 4 * 6;
+
+    glGenVertexArrays(1, &data.vertexArrayHandle);
+    glGenBuffers(1, &data.vertexBufferHandle);
+    glGenBuffers(1, &data.elementBufferHandle);
+    BindVertexArray(data.vertexArrayHandle);
+    glBindBuffer(GL_ARRAY_BUFFER, data.vertexBufferHandle);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * vertices.size(), vertices.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, data.elementBufferHandle);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * elements.size(), elements.data(), GL_STATIC_DRAW);
+}
+
+void UploadModelInstances(ModelRenderData &data, const std::vector<ModelInstance> &instances) {
+    glGenBuffers(1, &data.instanceBufferHandle);
+    glBindBuffer(GL_ARRAY_BUFFER, data.instanceBufferHandle);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(ModelInstance) * instances.size(), instances.data(), GL_STATIC_DRAW);
+    for (GLuint column = 0; column < 4; ++column) {
+        glVertexAttribPointer(3 + column, 4, GL_FLOAT, GL_FALSE, sizeof(ModelInstance),
+                              (void *)(offsetof(ModelInstance, transform) + sizeof(glm::vec4) * column));
+        glVertexAttribDivisor(3 + column, 1);
+        glEnableVertexAttribArray(3 + column);
+    }
+    glVertexAttribPointer(7, 2, GL_FLOAT, GL_FALSE, sizeof(ModelInstance), (void *)(offsetof(ModelInstance, skinLayer)));
+    glVertexAttribDivisor(7, 1);
+    glEnableVertexAttribArray(7);
+    data.instanceCount = instances.size();
+}
+
+GLuint GetTextureArrayFromImages(const std::vector<ImageData> &images) {
+    GLuint textureHandle;
+    glGenTextures(1, &textureHandle);
+    BindTexture(GL_TEXTURE_2D_ARRAY, textureHandle);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA, images[0].width, images[0].height, images.size(), 0, GL_RGBA,
+                 GL_UNSIGNED_BYTE, nullptr);
+    for (size_t layer = 0; layer < images.size(); ++layer) {
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, images[layer].width, images[layer].height, 1, GL_RGBA,
+                        GL_UNSIGNED_BYTE, images[layer].data);
+    }
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    return textureHandle;
+}
+
+// The input skin as a single instance, or every player of scene= as one instance each.
+std::vector<ModelInstance> LoadModelInstances(std::vector<ImageData> &skins) {
+    std::vector<ModelInstance> instances;
+    if (Global::scenePath.empty()) {
+        skins.push_back(LoadSkinImage());
+        instances.push_back(ModelInstance{glm::mat4(1.0f), 0.0f, skins[0].upscaleRGBA ? 1.0f : 0.0f});
+        return instances;
+    }
+    for (auto &player : LoadScene(Global::scenePath)) {
+        ImageData skin = LoadSkinImage(player.skinPath);
+        if (!skins.empty() && (skin.width != skins.front().width || skin.height != skins.front().height)) {
+            std::cerr << "ERROR: Scene skin \'" << player.skinPath << "\' differs in size from the first skin"
+                      << std::endl;
+            exit(-1);
         }
+        glm::mat4 transform = glm::translate(glm::mat4(1.0f), player.position);
+        transform = glm::rotate(transform, glm::radians(player.yaw), glm::vec3(0.0f, 1.0f, 0.0f));
+        instances.push_back(ModelInstance{transform, static_cast<float>(skins.size()), skin.upscaleRGBA ? 1.0f : 0.0f});
+        skins.push_back(skin);
     }
+    std::cout << "INFO: scene has " << instances.size() << " players" << std::endl;
+    return instances;
+}
 
-    glUseProgram(Global::modelPipelineInfo.programHandle);
+// One Camera block per view, each at a multiple of GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT so a view is selected with
+// glBindBufferRange alone. Called by PrepareModel and again by whoever changes camaraMatrices or projectMatrix.
+void UploadModelCamera(const ModelRenderData &data) {
+    std::vector<unsigned char> blocks(data.cameraStride * data.camaraMatrices.size());
+    for (size_t view = 0; view < data.camaraMatrices.size(); ++view) {
+        std::memcpy(&blocks[view * data.cameraStride], glm::value_ptr(data.camaraMatrices[view]), sizeof(glm::mat4));
+        std::memcpy(&blocks[view * data.cameraStride + sizeof(glm::mat4)], glm::value_ptr(data.projectMatrix),
+                    sizeof(glm::mat4));
+    }
+    glBindBuffer(GL_UNIFORM_BUFFER, data.cameraBufferHandle);
+    glBufferData(GL_UNIFORM_BUFFER, blocks.size(), blocks.data(), GL_STREAM_DRAW);
+}
 
-    glEnable(GL_DEPTH_TEST);
-    glBindVertexArray(vertexArrayHandle);
-    glBindBuffer(GL_ARRAY_BUFFER, vertexBufferHandle);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(float) * vertexData.size(), vertexData.data(), GL_STATIC_DRAW);
-    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void *)(0));
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void *)(4 * sizeof(float)));
+// Uploads geometry, instances and skins once. Models on the half unit and texel grid (the shipped ones) use the packed
+// vertex format and can change pose later through SetModelPose.
+ModelRenderData PrepareModel(unsigned int width, unsigned int height, const ModelPose &pose) {
+    auto models = LoadSelectedModel();
+    auto config = LoadSelectedModelConfig();
+    std::vector<ImageData> skins;
+    std::vector<ModelInstance> instances = LoadModelInstances(skins);
+    ModelRenderData data;
+    data.upscaleRGBA = skins.front().upscaleRGBA ? 1 : 0;
+    for (auto &skin : skins) {
+        if ((skin.upscaleRGBA ? 1 : 0) != data.upscaleRGBA) data.upscaleRGBA = -1;
+    }
+    data.specializeShaders = true;
+    for (auto &camera : GetSelectedCameras(config)) {
+        data.camaraMatrices.push_back(GetViewMatrix(camera));
+    }
+    data.viewWidth = width;
+    data.viewHeight = height;
+    data.projectMatrix = GetProjectMatrix(config, width, height);
+    GLint alignment = 1;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    data.cameraStride = (sizeof(glm::mat4) * 2 + alignment - 1) / alignment * alignment;
+    glGenBuffers(1, &data.cameraBufferHandle);
+    UploadModelCamera(data);
+
+    PackedModelGeometry packedGeometry;
+    if (BuildPackedModelGeometry(models, config, packedGeometry, pose)) {
+        DropTransparentAttachmentFaces(packedGeometry, skins);
+        UploadModelVertices(data, packedGeometry.baseVertices, packedGeometry.attachmentVertices);
+        // w of the three component position defaults to 1
+        glVertexAttribPointer(0, 3, GL_SHORT, GL_FALSE, sizeof(PackedModelVertex),
+                              (void *)(offsetof(PackedModelVertex, position)));
+        glVertexAttribPointer(1, 2, GL_UNSIGNED_BYTE, GL_FALSE, sizeof(PackedModelVertex),
+                              (void *)(offsetof(PackedModelVertex, textureCoord)));
+        glVertexAttribIPointer(2, 1, GL_UNSIGNED_BYTE, sizeof(PackedModelVertex),
+                               (void *)(offsetof(PackedModelVertex, part)));
+        glEnableVertexAttribArray(2);
+        data.partMatrices = packedGeometry.partMatrices;
+        data.parts = packedGeometry.parts;
+        data.textureScale = 1.0f / 64.0f;
+    } else {
+        std::cout << "INFO: model is off the packed vertex grid, using float vertices" << std::endl;
+        ModelGeometry geometry = BuildModelGeometry(models, config, pose);
+        DropTransparentAttachmentFaces(geometry, skins);
+        UploadModelVertices(data, geometry.baseVertices, geometry.attachmentVertices);
+        glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(ModelVertex),
+                              (void *)(offsetof(ModelVertex, position)));
+        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(ModelVertex),
+                              (void *)(offsetof(ModelVertex, textureCoord)));
+        glDisableVertexAttribArray(2);
+        glVertexAttribI4ui(2, 0, 0, 0, 0);
+        data.partMatrices.assign(1, glm::mat4(1.0f));
+        data.textureScale = 1.0f;
+    }
     glEnableVertexAttribArray(0);
     glEnableVertexAttribArray(1);
+    UploadModelInstances(data, instances);
 
-    ImageData image = GetImageDataFromPNG(Global::inputFilePath, Global::signatureLength, true);
-	upscaleRGBA = image.upscaleRGBA;
-    if (image.width / image.height == 2) {
-        FilpImageVertically(image);
-        ImageData newImage = ExtendSkin32x(image, Global::thinArm);
-        delete[] image.data;
-        image = newImage;
-        FilpImageVertically(image);
+    data.textureHandle = GetTextureArrayFromImages(skins);
+    for (auto &skin : skins) {
+        delete[] skin.data;
     }
-    textureHandle = GetTextureFromImage(image);
-    delete[] image.data;
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, textureHandle);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    GLuint samplerLocation = glGetUniformLocation(Global::modelPipelineInfo.programHandle, "textureSampler");
-    GLuint transparentSwitchLocation =
-        glGetUniformLocation(Global::modelPipelineInfo.programHandle, "disableTransparent");
-	GLuint upscaleRGBAFlagLocation =
-		glGetUniformLocation(Global::modelPipelineInfo.programHandle, "upscaleRGBA");
-
-    glUniform1i(samplerLocation, 0);
-	glUniform1i(upscaleRGBAFlagLocation, upscaleRGBA ? 1 : 0);
-
-    GLuint viewMatrixUniform = glGetUniformLocation(Global::modelPipelineInfo.programHandle, "viewMatrix");
-    GLuint projectMatrixUniform = glGetUniformLocation(Global::modelPipelineInfo.programHandle, "projectMatrix");
-    glUniformMatrix4fv(viewMatrixUniform, 1, GL_FALSE, glm::value_ptr(camaraMatrix));
-    glUniformMatrix4fv(projectMatrixUniform, 1, GL_FALSE, glm::value_ptr(projectMatrix));
+    data.config = config;
+    return data;
+}
 
+// Only the part matrices change, they reach the shader with the next BindModel. Returns false for unpacked vertices.
+bool SetModelPose(ModelRenderData &data, const ModelPose &pose) {
+    if (data.parts.empty()) return false;
+    data.partMatrices = GetPackedPartMatrices(data.parts, data.config, pose);
+    return true;
+}
+
+// The model program compiled with DISABLE_TRANSPARENT and UPSCALE_RGBA defined, so its fragments do not branch on
+// uniforms. -1 leaves a switch to the uniform or the instance; both -1 is the unspecialized program. Variants are
+// compiled on first use. The transparent rules do not look at UPSCALE_RGBA, so those variants share a program.
+const PipelineInfo &GetModelPipeline(int disableTransparent, int upscaleRGBA) {
+    if (disableTransparent == 1) upscaleRGBA = -1;
+    if (disableTransparent == -1 && upscaleRGBA == -1) return Global::modelPipelineInfo;
+    auto key = std::make_pair(disableTransparent, upscaleRGBA);
+    auto iterator = Global::modelPipelineVariants.find(key);
+    if (iterator != Global::modelPipelineVariants.end()) return iterator->second;
+    std::vector<std::pair<std::string, int>> defines;
+    if (disableTransparent != -1) defines.push_back(std::make_pair("DISABLE_TRANSPARENT", disableTransparent));
+    if (upscaleRGBA != -1) defines.push_back(std::make_pair("UPSCALE_RGBA", upscaleRGBA));
+    PipelineInfo info = SynthesizePipeline(Global::vertexShaderPath, Global::fragmentShaderPath, defines);
+    return Global::modelPipelineVariants[key] = info;
+}
+
+// Returns the program the draws have to use.
+const PipelineInfo &BindModel(const ModelRenderData &data, bool disableTransparent) {
+    const PipelineInfo &pipeline = data.specializeShaders
+                                       ? GetModelPipeline(disableTransparent ? 1 : 0, data.upscaleRGBA)
+                                       : Global::modelPipelineInfo;
+    UseProgram(pipeline.programHandle);
+    BindVertexArray(data.vertexArrayHandle);
+    BindTexture(GL_TEXTURE_2D_ARRAY, data.textureHandle);
+    glUniform1i(GetUniformLocation(pipeline, "textureSampler"), 0);
+    // -1, and ignored, for specialized programs
+    glUniform1i(GetUniformLocation(pipeline, "disableTransparent"), disableTransparent ? 1 : 0);
+    glUniformMatrix4fv(GetUniformLocation(pipeline, "partMatrices"), data.partMatrices.size(), GL_FALSE,
+                       glm::value_ptr(data.partMatrices.front()));
+    glUniform1f(GetUniformLocation(pipeline, "textureScale"), data.textureScale);
+    // camera blocks are already uploaded, DrawModelViews binds them per view
+    if (!pipeline.cameraBlock) {
+        glUniformMatrix4fv(GetUniformLocation(pipeline, "projectMatrix"), 1, GL_FALSE,
+                           glm::value_ptr(data.projectMatrix));
+    }
+    return pipeline;
+}
+
+void DrawModelViews(const ModelRenderData &data, const PipelineInfo &pipeline, GLsizei elementCount,
+                    GLsizei elementOffset) {
+    GLint viewMatrixUniform = GetUniformLocation(pipeline, "viewMatrix");
+    for (size_t view = 0; view < data.camaraMatrices.size(); ++view) {
+        glViewport(view * data.viewWidth, 0, data.viewWidth, data.viewHeight);
+        if (pipeline.cameraBlock) {
+            glBindBufferRange(GL_UNIFORM_BUFFER, cameraBlockBinding, data.cameraBufferHandle, view * data.cameraStride,
+                              sizeof(glm::mat4) * 2);
+        } else {
+            glUniformMatrix4fv(viewMatrixUniform, 1, GL_FALSE, glm::value_ptr(data.camaraMatrices[view]));
+        }
+        glDrawElementsInstanced(GL_TRIANGLES, elementCount, GL_UNSIGNED_INT, (void *)(sizeof(GLuint) * elementOffset),
+                                data.instanceCount);
+    }
+}
+
+// The base boxes are closed and always opaque, so their back faces can never be seen. Attachment back faces show
+// through transparent texels of the front faces and stay unculled.
+void DrawModelBaseLayer(const ModelRenderData &data) {
+    const PipelineInfo &pipeline = BindModel(data, true);
+    SetCapability(GL_DEPTH_TEST, true);
+    SetDepthFunc(GL_LESS);
+    SetDepthMask(GL_TRUE);
+    SetCapability(GL_BLEND, false);
+    SetCapability(GL_CULL_FACE, true);
+    SetFrontFace(GL_CCW);
+    SetCullFace(GL_BACK);
+    DrawModelViews(data, pipeline, data.baseElementCount, 0);
+}
+
+void DrawModelAttachmentLayer(const ModelRenderData &data) {
+    const PipelineInfo &pipeline = BindModel(data, false);
+    SetCapability(GL_DEPTH_TEST, true);
+    SetDepthFunc(GL_LESS);
+    SetDepthMask(GL_TRUE);
+    SetCapability(GL_CULL_FACE, false);
+    SetCapability(GL_BLEND, true);
+    // keep destination alpha meaningful for transparent output
+    SetBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    DrawModelViews(data, pipeline, data.attachmentElementCount, data.baseElementCount);
+}
+
+void ReleaseModel(ModelRenderData &data) {
+    glDeleteBuffers(1, &data.vertexBufferHandle);
+    glDeleteBuffers(1, &data.elementBufferHandle);
+    glDeleteBuffers(1, &data.instanceBufferHandle);
+    glDeleteBuffers(1, &data.cameraBufferHandle);
+    DeleteTexture(data.textureHandle);
+    DeleteVertexArray(data.vertexArrayHandle);
+}
+
+void RenderModel(unsigned int width, unsigned int height) {
+    ModelRenderData data = PrepareModel(width, height, GetSelectedPose());
     glClear(GL_DEPTH_BUFFER_BIT);
-    glBindVertexArray(vertexArrayHandle);
-    glUniform1i(transparentSwitchLocation, 1);
-    glMultiDrawArrays(GL_TRIANGLE_FAN, renderIndex.data(), renderCount.data(), renderCount.size());
+    DrawModelBaseLayer(data);
+    DrawModelAttachmentLayer(data);
+    ReleaseModel(data);
+}
+
+// view=face: 2D avatar straight from the skin, centered as the largest square that fits the frame. No GL at all.
+void RenderFaceView() {
+    ImageData skin = LoadSkinImage();
+    ImageData face = ComposeFace(skin);
+    delete[] skin.data;
+    ImageData layer;
+    layer.width = Global::frameWidth;
+    layer.height = Global::frameHeight;
+    layer.bytePerPixel = 4;
+    layer.upscaleRGBA = false;
+    layer.data = new unsigned char[static_cast<size_t>(layer.width) * layer.height * 4];
+    std::memset(layer.data, 0, static_cast<size_t>(layer.width) * layer.height * 4);
+    unsigned int size = std::min(layer.width, layer.height);
+    UpscaleNearest(face, layer, (layer.width - size) / 2, (layer.height - size) / 2, size, size);
+    delete[] face.data;
+    // the face is opaque and the rest is cleared, so the layer already counts as premultiplied
+    ImageData image = ComposeModelLayer(layer);
+    delete[] layer.data;
+    SaveImage(image);
+    delete[] image.data;
+}
+
+// Empty model layer with one frame cell per view.
+ImageData CreateViewAtlas(size_t viewCount) {
+    ImageData atlas;
+    atlas.width = Global::frameWidth * viewCount;
+    atlas.height = Global::frameHeight;
+    atlas.bytePerPixel = 4;
+    atlas.upscaleRGBA = false;
+    atlas.data = new unsigned char[static_cast<size_t>(atlas.width) * atlas.height * 4];
+    return atlas;
+}
+
+// backend=cpu: renders the model layer with the software rasterizer, no GL context is created.
+void RenderSoftware() {
+    auto models = LoadSelectedModel();
+    auto config = LoadSelectedModelConfig();
+    ModelGeometry geometry = BuildModelGeometry(models, config, GetSelectedPose());
+    ImageData texture = LoadSkinImage();
+    DropTransparentAttachmentFaces(geometry, {texture});
+    std::vector<ModelCamera> cameras = GetSelectedCameras(config);
+    ImageData layer = CreateViewAtlas(cameras.size());
+    for (size_t view = 0; view < cameras.size(); ++view) {
+        ImageData cell = RasterizeModel(geometry, texture, GetViewMatrix(cameras[view]),
+                                        GetProjectMatrix(config, Global::frameWidth, Global::frameHeight),
+                                        Global::frameWidth, Global::frameHeight);
+        PasteImage(cell, layer, view * Global::frameWidth, 0);
+        delete[] cell.data;
+    }
+    delete[] texture.data;
+    PremultiplyAlpha(layer);
+    if (!Global::layerCachePath.empty()) {
+        WriteImageData(layer, "rgba", GetModelLayerCacheFile(), true);
+    }
+    SaveViews(layer, cameras.size(), true);
+    delete[] layer.data;
+}
+
+// backend=isometric|texelmap: the model layer is gathered through a texel map cached per camera, frame size and model.
+// isometric forces an orthographic camera and scans faces analytically, texelmap rasterizes the map for any camera.
+void RenderTexelMap() {
+    auto config = LoadSelectedModelConfig();
+    bool isometric = Global::backend == "isometric";
+    if (isometric) config.orthographic = true;
+    std::vector<ModelCamera> cameras = GetSelectedCameras(config);
+    ImageData texture = LoadSkinImage();
+    ImageData layer = CreateViewAtlas(cameras.size());
+    for (size_t view = 0; view < cameras.size(); ++view) {
+        const ModelCamera &camera = cameras[view];
+        const TexelMap &map = GetTexelMap(Global::backend + '#' + std::to_string(view), [&config, &camera, isometric]() {
+            auto models = LoadSelectedModel();
+            ModelGeometry geometry = BuildModelGeometry(models, config, GetSelectedPose());
+            glm::mat4 transformMatrix =
+                GetProjectMatrix(config, Global::frameWidth, Global::frameHeight) * GetViewMatrix(camera);
+            return isometric
+                       ? BuildIsometricTexelMap(geometry, transformMatrix, Global::frameWidth, Global::frameHeight)
+                       : BuildPerspectiveTexelMap(geometry, transformMatrix, Global::frameWidth, Global::frameHeight);
+        });
+        ImageData cell = ApplyTexelMap(map, texture);
+        PasteImage(cell, layer, view * Global::frameWidth, 0);
+        delete[] cell.data;
+    }
+    delete[] texture.data;
+    PremultiplyAlpha(layer);
+    if (!Global::layerCachePath.empty()) {
+        WriteImageData(layer, "rgba", GetModelLayerCacheFile(), true);
+    }
+    SaveViews(layer, cameras.size(), true);
+    delete[] layer.data;
+}
+
+// Clear, background and model passes into the "color" and "depth" targets of an atlas with one cell per view. Without
+// a background only the model layer is drawn. earlyZ=1 draws the opaque base layer first and the background behind it
+// on the far plane, so pixels covered by the model are shaded once. With samples the targets are multisampled and a
+// resolve pass blits them into the single sampled "resolved" target. Returns the target to read the frame from.
+std::string AddModelFramePasses(FrameGraph &graph, ModelRenderData &model, const BackgroundRenderData *background,
+                                unsigned int samples = Global::samples) {
+    size_t viewCount = model.camaraMatrices.size();
+    GLsizei atlasWidth = model.viewWidth * viewCount;
+    DeclareFrameResource(graph, "color", {atlasWidth, model.viewHeight, GL_RGBA8, static_cast<GLsizei>(samples)});
+    // multisampled storage needs a sized depth format
+    GLenum depthFormat = samples > 0 ? GL_DEPTH_COMPONENT24 : GL_DEPTH_COMPONENT;
+    DeclareFrameResource(graph, "depth", {atlasWidth, model.viewHeight, depthFormat, static_cast<GLsizei>(samples)});
+    FramePass pass;
+    pass.colorAttachment = "color";
+    pass.depthAttachment = "depth";
+
+    pass.name = "clear color";
+    pass.writes = pass.overwrites = {"color"};
+    pass.execute = [atlasWidth, &model]() {
+        glViewport(0, 0, atlasWidth, model.viewHeight);
+        glClear(GL_COLOR_BUFFER_BIT);
+    };
+    AddFramePass(graph, pass);
+
+    pass.name = "clear depth";
+    pass.writes = pass.overwrites = {"depth"};
+    pass.execute = [atlasWidth, &model]() {
+        glViewport(0, 0, atlasWidth, model.viewHeight);
+        // the background behind the model leaves depth writes off
+        SetDepthMask(GL_TRUE);
+        glClear(GL_DEPTH_BUFFER_BIT);
+    };
+    AddFramePass(graph, pass);
+
+    bool behind = Global::earlyZ && background != nullptr && CanDrawBackgroundBehind();
+    if (Global::earlyZ && background != nullptr && !behind) {
+        std::cout << "INFO: background vertex shader has no backgroundDepth uniform, drawing it first" << std::endl;
+    }
+    pass.name = "background";
+    pass.execute = [viewCount, background, behind, &model]() {
+        for (size_t view = 0; view < viewCount; ++view) {
+            glViewport(view * model.viewWidth, 0, model.viewWidth, model.viewHeight);
+            DrawBackground(*background, behind);
+        }
+    };
+    if (background != nullptr && !behind) {
+        pass.writes = pass.overwrites = {"color"};
+        AddFramePass(graph, pass);
+    }
+    FramePass backgroundPass = pass;
+
+    pass.name = "base layer";
+    pass.reads = {"depth"};
+    pass.writes = {"color", "depth"};
+    pass.overwrites = {};
+    pass.execute = [&model]() { DrawModelBaseLayer(model); };
+    AddFramePass(graph, pass);
+
+    if (behind) {
+        backgroundPass.reads = {"depth"};
+        backgroundPass.writes = {"color"};
+        backgroundPass.overwrites = {};
+        AddFramePass(graph, backgroundPass);
+    }
 
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    glBindBuffer(GL_ARRAY_BUFFER, vertexBufferHandle);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(float) * attachVertexData.size(), attachVertexData.data(), GL_STATIC_DRAW);
-    glUniform1i(transparentSwitchLocation, 0);
-    glMultiDrawArrays(GL_TRIANGLE_FAN, renderIndex.data(), renderCount.data(), renderCount.size());
-    glDisable(GL_BLEND);
-    glFinish();
+    pass.name = "attachment layer";
+    pass.reads = {"color", "depth"};
+    pass.execute = [&model]() { DrawModelAttachmentLayer(model); };
+    AddFramePass(graph, pass);
+    if (samples == 0) return "color";
 
-    glDeleteBuffers(1, &vertexBufferHandle);
-    glDeleteTextures(1, &textureHandle);
-    glDeleteVertexArrays(1, &vertexArrayHandle);
+    DeclareFrameResource(graph, "resolved", {atlasWidth, model.viewHeight, GL_RGBA8, 0});
+    pass.name = "resolve";
+    pass.colorAttachment = "resolved";
+    pass.depthAttachment = "";
+    pass.reads = {"color"};
+    pass.writes = pass.overwrites = {"resolved"};
+    pass.execute = [atlasWidth, &graph, &model]() {
+        GLint resolvedFramebuffer;
+        glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &resolvedFramebuffer);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, GetFrameGraphFramebuffer(graph, "color", "depth"));
+        glBlitFramebuffer(0, 0, atlasWidth, model.viewHeight, 0, 0, atlasWidth, model.viewHeight,
+                          GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        // later passes on this framebuffer read from it again
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, resolvedFramebuffer);
+    };
+    AddFramePass(graph, pass);
+    return "resolved";
+}
+
+// Two pixel pack buffers used in turn: glReadPixels into one returns without waiting for the GPU, and the previous
+// frame, or band of rows, is mapped from the other one while the next one renders or copies.
+struct AsyncReadback {
+    GLuint bufferHandles[2];
+    bool alpha;
+    unsigned int width;
+    unsigned int height;   // rows per buffer
+    unsigned int rows[2];  // rows requested into each buffer
+};
+
+AsyncReadback CreateAsyncReadback(bool alpha, unsigned int width, unsigned int height) {
+    AsyncReadback readback;
+    readback.alpha = alpha;
+    readback.width = width;
+    readback.height = height;
+    glGenBuffers(2, readback.bufferHandles);
+    for (GLuint bufferHandle : readback.bufferHandles) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, bufferHandle);
+        glBufferData(GL_PIXEL_PACK_BUFFER, static_cast<size_t>(width) * height * (alpha ? 4 : 3), nullptr,
+                     GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    return readback;
+}
+
+// Rows [y, y + rows) of the bound framebuffer, the whole buffer height by default.
+void StartAsyncReadback(AsyncReadback &readback, size_t slot, unsigned int y = 0, unsigned int rows = 0) {
+    readback.rows[slot] = rows != 0 ? rows : readback.height;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.bufferHandles[slot]);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, y, readback.width, readback.rows[slot], readback.alpha ? GL_RGBA : GL_RGB, GL_UNSIGNED_BYTE,
+                 nullptr);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+ImageData FinishAsyncReadback(AsyncReadback &readback, size_t slot) {
+    ImageData image;
+    image.bytePerPixel = readback.alpha ? 4 : 3;
+    image.width = readback.width;
+    image.height = readback.rows[slot];
+    image.upscaleRGBA = false;
+    size_t size = static_cast<size_t>(image.width) * image.height * image.bytePerPixel;
+    image.data = new unsigned char[size];
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.bufferHandles[slot]);
+    void *pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+    if (pixels == nullptr) {
+        std::cerr << "ERROR: Unable to map the readback buffer" << std::endl;
+        exit(-1);
+    }
+    std::memcpy(image.data, pixels, size);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    StraightenResolvedAlpha(image);
+    return image;
+}
+
+void ReleaseAsyncReadback(AsyncReadback &readback) { glDeleteBuffers(2, readback.bufferHandles); }
+
+// Streams the bound framebuffer into a PNG in bands of rows, top band first. The next band is requested before the
+// current one is mapped and encoded, so at most two bands are held no matter how large the frame is.
+void StreamFrameToPNG(bool alpha, unsigned int width, unsigned int height, const std::string &filename) {
+    unsigned int bytePerPixel = alpha ? 4 : 3;
+    size_t rowSize = static_cast<size_t>(width) * bytePerPixel;
+    size_t bandRows = std::max<size_t>(1, (static_cast<size_t>(1) << 22) / rowSize);
+    unsigned int bandHeight = static_cast<unsigned int>(std::min<size_t>(height, bandRows));
+    AsyncReadback readback = CreateAsyncReadback(alpha, width, bandHeight);
+    PNGRowWriter writer = BeginPNGRows(filename, width, height, bytePerPixel);
+    auto startBand = [&readback, height, bandHeight](unsigned int band) {
+        unsigned int bandTop = height - band * bandHeight;
+        unsigned int rows = std::min(bandHeight, bandTop);
+        StartAsyncReadback(readback, band % 2, bandTop - rows, rows);
+    };
+    unsigned int bandCount = (height + bandHeight - 1) / bandHeight;
+    startBand(0);
+    for (unsigned int band = 0; band < bandCount; ++band) {
+        if (band + 1 < bandCount) startBand(band + 1);
+        ImageData rows = FinishAsyncReadback(readback, band % 2);
+        for (unsigned int row = rows.height; row-- > 0;) {
+            WritePNGRow(writer, &rows.data[row * rowSize]);
+        }
+        delete[] rows.data;
+    }
+    FinishPNGRows(writer);
+    ReleaseAsyncReadback(readback);
 }
 
 void Render() {
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
     if (Global::keepWindow) {
-        RenderBackground();
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        if (!Global::transparentBackground) RenderBackground();
         RenderModel(Global::windowWidth, Global::windowHeight);
+        glFlush();
         while (!glfwWindowShouldClose(Global::mainWindow)) {
             glfwPollEvents();
         }
     }
 
-    GLuint framebufferHandle;
-    GLuint renderbufferColorHandle;
-    GLuint renderbufferDSHandle;
+    // with a layer cache the background is composited on the CPU instead
+    bool modelLayerOnly = Global::transparentBackground || !Global::layerCachePath.empty();
+    ModelRenderData model = PrepareModel(Global::frameWidth, Global::frameHeight, GetSelectedPose());
+    BackgroundRenderData background;
+    if (!modelLayerOnly) background = PrepareBackground();
+    size_t viewCount = model.camaraMatrices.size();
+    GLsizei atlasWidth = Global::frameWidth * viewCount;
+    ImageData image;
+    // a single PNG needs no whole frame in memory: rows go from the readback buffers straight to the encoder
+    bool stream = Global::outputFormat == "png" && !Global::paletteOutput && Global::layerCachePath.empty() &&
+                  Global::outputSizes.empty() && (viewCount == 1 || !Global::separateViews) &&
+                  Global::benchmark.empty();
 
-    GLint maxSamples;
+    FrameGraph graph;
+    std::string target = AddModelFramePasses(graph, model, modelLayerOnly ? nullptr : &background);
+    FramePass pass;
+    pass.name = "readback";
+    pass.colorAttachment = target;
+    pass.depthAttachment = target == "color" ? "depth" : "";
+    pass.reads = {target};
+    pass.sideEffect = true;
+    pass.execute = [&image, modelLayerOnly, atlasWidth, stream]() {
+        if (stream) {
+            StreamFrameToPNG(modelLayerOnly, atlasWidth, Global::frameHeight, Global::outputFilePath);
+        } else {
+            image = ReadFrameImage(modelLayerOnly, atlasWidth, Global::frameHeight);
+        }
+    };
+    AddFramePass(graph, pass);
 
-    glGetIntegerv(GL_MAX_SAMPLES, &maxSamples);
+    CompileFrameGraph(graph);
+    ExecuteFrameGraph(graph);
+    ReleaseFrameGraph(graph);
+    if (!modelLayerOnly) ReleaseBackground(background);
+    ReleaseModel(model);
+    if (stream) return;
 
-    glGenFramebuffers(1, &framebufferHandle);
-    glGenRenderbuffers(1, &renderbufferColorHandle);
-    glGenRenderbuffers(1, &renderbufferDSHandle);
-    glBindFramebuffer(GL_FRAMEBUFFER, framebufferHandle);
-    glBindRenderbuffer(GL_RENDERBUFFER, renderbufferDSHandle);
-    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, Global::frameWidth, Global::frameHeight);
-    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, renderbufferDSHandle);
-    glBindRenderbuffer(GL_RENDERBUFFER, renderbufferColorHandle);
-    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, Global::frameWidth, Global::frameHeight);
-    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbufferColorHandle);
+    if (!Global::layerCachePath.empty()) {
+        PremultiplyAlpha(image);
+        WriteImageData(image, "rgba", GetModelLayerCacheFile(), true);
+    }
+    SaveViews(image, viewCount, !Global::layerCachePath.empty());
+    delete[] image.data;
+}
 
-    glBindFramebuffer(GL_FRAMEBUFFER, framebufferHandle);
-    glViewport(0, 0, Global::frameWidth, Global::frameHeight);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+// The tile edge for RenderTiled(), 0 renders the frame in one piece. Frames beyond GL_MAX_RENDERBUFFER_SIZE are tiled
+// without tileSize= as well.
+unsigned int GetTileSize() {
+    GLint maxRenderbufferSize = 0;
+    glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &maxRenderbufferSize);
+    GLint maxViewportSize[2] = {0, 0};
+    glGetIntegerv(GL_MAX_VIEWPORT_DIMS, maxViewportSize);
+    unsigned int maxSize = std::min({maxRenderbufferSize, maxViewportSize[0], maxViewportSize[1]});
+    size_t viewCount = GetSelectedCameras(LoadSelectedModelConfig()).size();
+    bool tooLarge =
+        Global::frameWidth * viewCount > maxSize || static_cast<unsigned int>(Global::frameHeight) > maxSize;
+    if (Global::tileSize == 0 && !tooLarge) return 0;
+    if (Global::outputFormat != "png" || Global::paletteOutput || Global::separateViews || Global::keepWindow ||
+        !Global::layerCachePath.empty() || !Global::outputSizes.empty() || !Global::animation.empty()) {
+        std::cerr << "ERROR: tiled rendering streams one outputFormat=png image, without palette=, atlas=separate, "
+                     "keepWindow=, layerCache=, sizes= or animate="
+                  << std::endl;
+        if (tooLarge) std::cerr << "ERROR: the frame exceeds the GL limit of " << maxSize << " pixels" << std::endl;
+        exit(-1);
+    }
+    unsigned int tileSize = Global::tileSize != 0 ? Global::tileSize : 2048;
+    return std::min(tileSize, maxSize);
+}
 
-    RenderBackground();
-    RenderModel(Global::frameWidth, Global::frameHeight);
+// Renders the frame tile by tile into one small tileSize x tileSize target and streams it into the PNG a band of
+// tiles at a time, top band first. Memory is one band, atlas width x tileSize, regardless of the frame height. Each
+// tile uses a sub-frustum of the view's projection, the background quad samples the matching part of the background.
+void RenderTiled(unsigned int tileSize) {
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    bool alpha = Global::transparentBackground;
+    unsigned int bytePerPixel = alpha ? 4 : 3;
+    ModelRenderData model = PrepareModel(Global::frameWidth, Global::frameHeight, GetSelectedPose());
+    std::vector<glm::mat4> camaraMatrices = model.camaraMatrices;
+    glm::mat4 projectMatrix = model.projectMatrix;
+    model.camaraMatrices.resize(1);
+    model.viewWidth = tileSize;
+    model.viewHeight = tileSize;
+    BackgroundRenderData background;
+    if (!alpha) background = PrepareBackground();
+    size_t atlasWidth = static_cast<size_t>(Global::frameWidth) * camaraMatrices.size();
+    std::cout << "INFO: rendering " << atlasWidth << '*' << Global::frameHeight << " in " << tileSize << '*'
+              << tileSize << " tiles" << std::endl;
+    PNGRowWriter writer = BeginPNGRows(Global::outputFilePath, atlasWidth, Global::frameHeight, bytePerPixel);
+    size_t bandRowSize = atlasWidth * bytePerPixel;
+    size_t tileRowSize = static_cast<size_t>(tileSize) * bytePerPixel;
+    std::vector<unsigned char> band(bandRowSize * tileSize);
+    ImageData tile;
 
-    SaveImage();
+    FrameGraph graph;
+    std::string target = AddModelFramePasses(graph, model, alpha ? nullptr : &background);
+    FramePass pass;
+    pass.name = "readback";
+    pass.colorAttachment = target;
+    pass.depthAttachment = target == "color" ? "depth" : "";
+    pass.reads = {target};
+    pass.sideEffect = true;
+    pass.execute = [&tile, alpha, tileSize]() { tile = ReadFrameImage(alpha, tileSize, tileSize); };
+    AddFramePass(graph, pass);
+    CompileFrameGraph(graph);
 
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    for (unsigned int bandTop = Global::frameHeight; bandTop > 0;) {
+        unsigned int bandHeight = std::min(tileSize, bandTop);
+        // the lowest band's tiles reach below the frame, their first rows are dropped
+        int tileY = static_cast<int>(bandTop) - static_cast<int>(tileSize);
+        unsigned int skippedRows = tileSize - bandHeight;
+        for (size_t view = 0; view < camaraMatrices.size(); ++view) {
+            model.camaraMatrices[0] = camaraMatrices[view];
+            for (unsigned int tileX = 0; tileX < static_cast<unsigned int>(Global::frameWidth); tileX += tileSize) {
+                model.projectMatrix = GetTileProjectMatrix(projectMatrix, Global::frameWidth, Global::frameHeight,
+                                                           tileX, tileY, tileSize, tileSize);
+                UploadModelCamera(model);
+                if (!alpha) {
+                    SetBackgroundRegion(background, static_cast<float>(tileX) / Global::frameWidth,
+                                        static_cast<float>(tileY) / Global::frameHeight,
+                                        static_cast<float>(tileX + tileSize) / Global::frameWidth,
+                                        static_cast<float>(tileY + static_cast<int>(tileSize)) / Global::frameHeight);
+                }
+                ExecuteFrameGraph(graph);
+                size_t columns = std::min(tileSize, Global::frameWidth - tileX) * bytePerPixel;
+                for (unsigned int row = 0; row < bandHeight; ++row) {
+                    std::memcpy(&band[row * bandRowSize + (view * Global::frameWidth + tileX) * bytePerPixel],
+                                &tile.data[(row + skippedRows) * tileRowSize], columns);
+                }
+                delete[] tile.data;
+            }
+        }
+        for (unsigned int row = bandHeight; row-- > 0;) {
+            WritePNGRow(writer, &band[row * bandRowSize]);
+        }
+        bandTop -= bandHeight;
+    }
+    FinishPNGRows(writer);
 
-    glDeleteRenderbuffers(1, &renderbufferColorHandle);
-    glDeleteRenderbuffers(1, &renderbufferDSHandle);
-    glDeleteFramebuffers(1, &framebufferHandle);
+    ReleaseFrameGraph(graph);
+    if (!alpha) ReleaseBackground(background);
+    ReleaseModel(model);
+}
+
+// animate=: geometry, skins and background stay uploaded and the frame graph is compiled once; a frame only sets new
+// view and part matrices, draws and starts its readback, then encodes the frame before it.
+void RenderAnimation() {
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    bool modelLayerOnly = Global::transparentBackground;
+    ModelRenderData model = PrepareModel(Global::frameWidth, Global::frameHeight, GetSelectedPose());
+    bool animatePose = GetSelectedPoseAnimation().size() > 1;
+    if (animatePose && model.parts.empty()) {
+        std::cout << "INFO: model is off the packed vertex grid, the pose stays at its first frame" << std::endl;
+        animatePose = false;
+    }
+    BackgroundRenderData background;
+    if (!modelLayerOnly) background = PrepareBackground();
+    std::vector<ModelCamera> cameras = GetSelectedCameras(LoadSelectedModelConfig());
+    GLsizei atlasWidth = Global::frameWidth * cameras.size();
+    AsyncReadback readback = CreateAsyncReadback(modelLayerOnly, atlasWidth, Global::frameHeight);
+    AnimationWriter writer = BeginAnimation(Global::outputFilePath, Global::outputFormat, atlasWidth,
+                                            Global::frameHeight, modelLayerOnly ? 4 : 3, Global::animationFrames,
+                                            Global::animationDelay);
+    unsigned int frame = 0;
+
+    FrameGraph graph;
+    std::string target = AddModelFramePasses(graph, model, modelLayerOnly ? nullptr : &background);
+    FramePass pass;
+    pass.name = "async readback";
+    pass.colorAttachment = target;
+    pass.depthAttachment = target == "color" ? "depth" : "";
+    pass.reads = {target};
+    pass.sideEffect = true;
+    pass.execute = [&readback, &frame]() { StartAsyncReadback(readback, frame % 2); };
+    AddFramePass(graph, pass);
+    CompileFrameGraph(graph);
+
+    for (frame = 0; frame < Global::animationFrames; ++frame) {
+        float progress = static_cast<float>(frame) / Global::animationFrames;
+        if (Global::animation == "turntable") {
+            for (size_t view = 0; view < cameras.size(); ++view) {
+                model.camaraMatrices[view] =
+                    GetViewMatrix(GetTurntableCamera(cameras[view], glm::radians(360.0f) * progress));
+            }
+            UploadModelCamera(model);
+        }
+        if (animatePose) SetModelPose(model, GetSelectedPose(progress));
+        ExecuteFrameGraph(graph);
+        if (frame > 0) {
+            ImageData image = FinishAsyncReadback(readback, (frame - 1) % 2);
+            AddAnimationFrame(writer, image, true);
+            delete[] image.data;
+        }
+    }
+    ImageData image = FinishAsyncReadback(readback, (frame - 1) % 2);
+    AddAnimationFrame(writer, image, true);
+    delete[] image.data;
+    FinishAnimation(writer);
+    std::cout << "INFO: wrote " << Global::animationFrames << " animation frames" << std::endl;
+
+    ReleaseFrameGraph(graph);
+    ReleaseAsyncReadback(readback);
+    if (!modelLayerOnly) ReleaseBackground(background);
+    ReleaseModel(model);
+}
+
+// benchmark=msaa: frame time with samples=2, 4 and 8 (as far as GL_MAX_SAMPLES allows) against rendering at twice the
+// size and shrinking on the CPU. Every frame includes its synchronous readback. LIBGL_ALWAYS_SOFTWARE=1 measures
+// llvmpipe.
+void BenchmarkAntialiasing(unsigned int iterations = 10) {
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    GLint maxSamples = 0;
+    glGetIntegerv(GL_MAX_SAMPLES, &maxSamples);
+    std::cout << "BENCHMARK: antialiasing " << Global::frameWidth << '*' << Global::frameHeight << " frames on "
+              << glGetString(GL_RENDERER) << ", " << iterations << " iterations" << std::endl;
+    BackgroundRenderData background = PrepareBackground();
+    auto measure = [&background, iterations](const std::string &name, unsigned int scale, unsigned int samples) {
+        ModelRenderData model =
+            PrepareModel(Global::frameWidth * scale, Global::frameHeight * scale, GetSelectedPose());
+        GLsizei atlasWidth = model.viewWidth * model.camaraMatrices.size();
+        ImageData image;
+        FrameGraph graph;
+        std::string target = AddModelFramePasses(graph, model, &background, samples);
+        FramePass pass;
+        pass.name = "readback";
+        pass.colorAttachment = target;
+        pass.depthAttachment = target == "color" ? "depth" : "";
+        pass.reads = {target};
+        pass.sideEffect = true;
+        pass.execute = [&image, &model, atlasWidth, scale]() {
+            image = ReadFrameImage(false, atlasWidth, model.viewHeight);
+            if (scale == 1) return;
+            ImageData shrunk = ShrinkImage(image, scale);
+            delete[] image.data;
+            image = shrunk;
+        };
+        AddFramePass(graph, pass);
+        CompileFrameGraph(graph);
+        // warm up: first use allocates the targets and compiles the driver state
+        ExecuteFrameGraph(graph);
+        delete[] image.data;
+        auto begin = std::chrono::steady_clock::now();
+        for (unsigned int iteration = 0; iteration < iterations; ++iteration) {
+            ExecuteFrameGraph(graph);
+            delete[] image.data;
+        }
+        auto end = std::chrono::steady_clock::now();
+        double milliseconds = std::chrono::duration<double, std::milli>(end - begin).count() / iterations;
+        std::cout << "BENCHMARK: " << std::setw(12) << std::left << name << std::right << std::setw(10) << std::fixed
+                  << std::setprecision(3) << milliseconds << " ms" << std::endl;
+        ReleaseFrameGraph(graph);
+        ReleaseModel(model);
+    };
+    measure("aliased", 1, 0);
+    for (unsigned int samples = 2; samples <= 8 && samples <= static_cast<unsigned int>(maxSamples); samples *= 2) {
+        measure("msaa x" + std::to_string(samples), 1, samples);
+    }
+    measure("supersample", 2, 0);
+    ReleaseBackground(background);
+}
+
+// benchmark=shading: GPU time of the base and attachment passes with the uniform branching model program and with
+// the specialized variants of GetModelPipeline(), measured with GL_TIME_ELAPSED queries. LIBGL_ALWAYS_SOFTWARE=1
+// measures llvmpipe, which compiles every variant into its own CPU code.
+void BenchmarkShading(unsigned int iterations = 20) {
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    ModelRenderData model = PrepareModel(Global::frameWidth, Global::frameHeight, GetSelectedPose());
+    GLsizei atlasWidth = model.viewWidth * model.camaraMatrices.size();
+    std::cout << "BENCHMARK: shading " << atlasWidth << '*' << model.viewHeight << " frames on "
+              << glGetString(GL_RENDERER) << ", " << iterations << " iterations" << std::endl;
+    GLuint queryHandles[2];
+    glGenQueries(2, queryHandles);
+    GLuint64 elapsed[2];
+
+    FrameGraph graph;
+    DeclareFrameResource(graph, "color", {atlasWidth, model.viewHeight, GL_RGBA8, 0});
+    DeclareFrameResource(graph, "depth", {atlasWidth, model.viewHeight, GL_DEPTH_COMPONENT, 0});
+    FramePass pass;
+    pass.colorAttachment = "color";
+    pass.depthAttachment = "depth";
+    pass.name = "clear";
+    pass.writes = pass.overwrites = {"color", "depth"};
+    pass.execute = [atlasWidth, &model]() {
+        glViewport(0, 0, atlasWidth, model.viewHeight);
+        SetDepthMask(GL_TRUE);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    };
+    AddFramePass(graph, pass);
+    pass.name = "base layer";
+    pass.reads = {"depth"};
+    pass.writes = {"color", "depth"};
+    pass.overwrites = {};
+    pass.execute = [&model, &queryHandles]() {
+        glBeginQuery(GL_TIME_ELAPSED, queryHandles[0]);
+        DrawModelBaseLayer(model);
+        glEndQuery(GL_TIME_ELAPSED);
+    };
+    AddFramePass(graph, pass);
+    pass.name = "attachment layer";
+    pass.reads = {"color", "depth"};
+    pass.execute = [&model, &queryHandles]() {
+        glBeginQuery(GL_TIME_ELAPSED, queryHandles[1]);
+        DrawModelAttachmentLayer(model);
+        glEndQuery(GL_TIME_ELAPSED);
+    };
+    AddFramePass(graph, pass);
+    pass.name = "query results";
+    pass.reads = {"color"};
+    pass.writes = {};
+    pass.sideEffect = true;
+    pass.execute = [&queryHandles, &elapsed]() {
+        glGetQueryObjectui64v(queryHandles[0], GL_QUERY_RESULT, &elapsed[0]);
+        glGetQueryObjectui64v(queryHandles[1], GL_QUERY_RESULT, &elapsed[1]);
+    };
+    AddFramePass(graph, pass);
+    CompileFrameGraph(graph);
+
+    for (bool specialize : {false, true}) {
+        model.specializeShaders = specialize;
+        // warm up: the variants compile on first use
+        ExecuteFrameGraph(graph);
+        double milliseconds[2] = {0.0, 0.0};
+        for (unsigned int iteration = 0; iteration < iterations; ++iteration) {
+            ExecuteFrameGraph(graph);
+            milliseconds[0] += elapsed[0] / 1e6 / iterations;
+            milliseconds[1] += elapsed[1] / 1e6 / iterations;
+        }
+        const char *variant = specialize ? "specialized" : "uniform";
+        std::cout << "BENCHMARK: base       " << std::setw(12) << std::left << variant << std::right << std::setw(10)
+                  << std::fixed << std::setprecision(3) << milliseconds[0] << " ms" << std::endl;
+        std::cout << "BENCHMARK: attachment " << std::setw(12) << std::left << variant << std::right << std::setw(10)
+                  << std::fixed << std::setprecision(3) << milliseconds[1] << " ms" << std::endl;
+    }
+    ReleaseFrameGraph(graph);
+    glDeleteQueries(2, queryHandles);
+    ReleaseModel(model);
+}
+
+// animate= with backend=cpu. The software rasterizer needs posed vertices, so an animated pose rebuilds the geometry
+// every frame.
+void RenderSoftwareAnimation() {
+    auto models = LoadSelectedModel();
+    auto config = LoadSelectedModelConfig();
+    ModelGeometry geometry = BuildModelGeometry(models, config, GetSelectedPose());
+    ImageData texture = LoadSkinImage();
+    DropTransparentAttachmentFaces(geometry, {texture});
+    bool animatePose = GetSelectedPoseAnimation().size() > 1;
+    std::vector<ModelCamera> cameras = GetSelectedCameras(config);
+    glm::mat4 projectMatrix = GetProjectMatrix(config, Global::frameWidth, Global::frameHeight);
+    ImageData layer = CreateViewAtlas(cameras.size());
+    AnimationWriter writer = BeginAnimation(Global::outputFilePath, Global::outputFormat, layer.width, layer.height,
+                                            Global::transparentBackground ? 4 : 3, Global::animationFrames,
+                                            Global::animationDelay);
+    for (unsigned int frame = 0; frame < Global::animationFrames; ++frame) {
+        float progress = static_cast<float>(frame) / Global::animationFrames;
+        float angle = Global::animation == "turntable" ? glm::radians(360.0f) * progress : 0.0f;
+        if (animatePose && frame > 0) {
+            geometry = BuildModelGeometry(models, config, GetSelectedPose(progress));
+            DropTransparentAttachmentFaces(geometry, {texture});
+        }
+        for (size_t view = 0; view < cameras.size(); ++view) {
+            ImageData cell = RasterizeModel(geometry, texture, GetViewMatrix(GetTurntableCamera(cameras[view], angle)),
+                                            projectMatrix, Global::frameWidth, Global::frameHeight);
+            PasteImage(cell, layer, view * Global::frameWidth, 0);
+            delete[] cell.data;
+        }
+        PremultiplyAlpha(layer);
+        ImageData image = ComposeViewSheet(layer, cameras.size());
+        AddAnimationFrame(writer, image, true);
+        delete[] image.data;
+    }
+    FinishAnimation(writer);
+    std::cout << "INFO: wrote " << Global::animationFrames << " animation frames" << std::endl;
+    delete[] layer.data;
+    delete[] texture.data;
 }
 
 void CleanupPipeline(PipelineInfo info) {
     glDeleteShader(info.fragmentShaderHandle);
     glDeleteShader(info.vertexShaderHandle);
-    glDeleteProgram(info.programHandle);
+    DeleteProgram(info.programHandle);
 }
 
 void Cleanup() {
-    CleanupPipeline(Global::backgroundPipelineInfo);
+    DestroyRenderTargetPool();
+    if (Global::backgroundPipelineInfo.programHandle != 0) CleanupPipeline(Global::backgroundPipelineInfo);
     CleanupPipeline(Global::modelPipelineInfo);
+    for (auto &variant : Global::modelPipelineVariants) {
+        CleanupPipeline(variant.second);
+    }
     glfwTerminate();
 }
 
@@ -532,8 +1805,38 @@ int main(int argc, char **argv) {
     ParseArguments(argc, argv);
     DumpArguments();
     ApplyArguments();
+    if (Global::view == "face") {
+        RenderFaceView();
+        return 0;
+    }
+    if (!Global::layerCachePath.empty() && RenderFromLayerCache()) {
+        return 0;
+    }
+    if (!Global::animation.empty() && Global::backend == "cpu") {
+        RenderSoftwareAnimation();
+        return 0;
+    }
+    if (Global::backend == "cpu") {
+        RenderSoftware();
+        return 0;
+    }
+    if (Global::backend == "isometric" || Global::backend == "texelmap") {
+        RenderTexelMap();
+        return 0;
+    }
     Initizalize();
-    Render();
+    unsigned int tileSize = Global::animation.empty() ? GetTileSize() : 0;
+    if (Global::benchmark == "msaa") {
+        BenchmarkAntialiasing();
+    } else if (Global::benchmark == "shading") {
+        BenchmarkShading();
+    } else if (!Global::animation.empty()) {
+        RenderAnimation();
+    } else if (tileSize != 0) {
+        RenderTiled(tileSize);
+    } else {
+        Render();
+    }
     Cleanup();
     return 0;
 }
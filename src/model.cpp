@@ -2,11 +2,15 @@
 #include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
 #include <glm/vec4.hpp>
+#include <glm/mat4x4.hpp>
+#include <glm/gtc/matrix_transform.hpp>
 
+#include <cmath>
 #include <fstream>
 #include <map>
 #include <memory>
 #include <numeric>
+#include <sstream>
 #include <string>
 #include <vector>
 
@@ -26,14 +30,29 @@ struct ObjModel {
     std::vector<Face> faces;
 };
 
+struct ModelCamera {
+    glm::vec3 eyePosition;
+    glm::vec3 eyeTarget;
+    glm::vec3 eyeUpDirection;
+};
+
 struct ModelConfig {
+    // the first camera
     glm::vec3 eyePosition;
     glm::vec3 eyeTarget;
     glm::vec3 eyeUpDirection;
 
+    // every eyePosition line starts another view, eyeTarget/eyeUpDirection carry over from the previous one
+    std::vector<ModelCamera> cameras;
+
+    bool orthographic = false;
+    float orthoHeight = 64.0f;  // world units covered by the frame height in orthographic projection
+
     std::map<std::string, glm::vec3> origins;
 
     std::map<std::string, float> attachmentScales;
+
+    std::map<std::string, glm::vec3> pivots;  // rotation centers in part space, see GetPartPivot
 };
 
 inline void DropLine(std::istream &stream) { stream.ignore(std::numeric_limits<std::streamsize>::max(), '\n'); }
@@ -101,6 +120,7 @@ ModelConfig LoadModelConfig(std::string filename) {
     std::ifstream input(filename, std::ios::in);
     ModelConfig ret;
     std::string token;
+    bool hasEyePosition = false;
     if (!input.is_open()) {
         std::cerr << "ERROR: Cannot open model config file\'" << filename << "\'." << std::endl;
         exit(-1);
@@ -131,15 +151,253 @@ ModelConfig LoadModelConfig(std::string filename) {
             ret.attachmentScales["LeftLeg"] = ReadFloat(input);
         else if (token == "rightLegAttachmentScale")
             ret.attachmentScales["RightLeg"] = ReadFloat(input);
-        else if (token == "eyePosition")
-            ret.eyePosition = ReadVec3(input);
-        else if (token == "eyeTarget")
-            ret.eyeTarget = ReadVec3(input);
-        else if (token == "eyeUpDirection")
-            ret.eyeUpDirection = ReadVec3(input);
+        else if (token == "headPivot")
+            ret.pivots["Head"] = ReadVec3(input);
+        else if (token == "bodyPivot")
+            ret.pivots["Body"] = ReadVec3(input);
+        else if (token == "leftArmPivot")
+            ret.pivots["LeftArm"] = ReadVec3(input);
+        else if (token == "rightArmPivot")
+            ret.pivots["RightArm"] = ReadVec3(input);
+        else if (token == "leftLegPivot")
+            ret.pivots["LeftLeg"] = ReadVec3(input);
+        else if (token == "rightLegPivot")
+            ret.pivots["RightLeg"] = ReadVec3(input);
+        else if (token == "eyePosition") {
+            if (ret.cameras.empty() || hasEyePosition) {
+                ret.cameras.push_back(ret.cameras.empty() ? ModelCamera() : ret.cameras.back());
+            }
+            ret.cameras.back().eyePosition = ReadVec3(input);
+            hasEyePosition = true;
+        } else if (token == "eyeTarget") {
+            if (ret.cameras.empty()) ret.cameras.push_back(ModelCamera());
+            ret.cameras.back().eyeTarget = ReadVec3(input);
+        } else if (token == "eyeUpDirection") {
+            if (ret.cameras.empty()) ret.cameras.push_back(ModelCamera());
+            ret.cameras.back().eyeUpDirection = ReadVec3(input);
+        }
+        else if (token == "projection") {
+            input >> token;
+            ret.orthographic = token == "orthographic";
+        } else if (token == "orthoHeight")
+            ret.orthoHeight = ReadFloat(input);
         DropLine(input);
         token.clear();
     } while (!input.eof());
     input.close();
+    if (!ret.cameras.empty()) {
+        ret.eyePosition = ret.cameras.front().eyePosition;
+        ret.eyeTarget = ret.cameras.front().eyeTarget;
+        ret.eyeUpDirection = ret.cameras.front().eyeUpDirection;
+    }
     return ret;
 }
+
+// The views of a config, configs without eye lines (like the embedded one) have just the eye fields.
+std::vector<ModelCamera> GetModelCameras(const ModelConfig &config) {
+    if (!config.cameras.empty()) return config.cameras;
+    return {ModelCamera{config.eyePosition, config.eyeTarget, config.eyeUpDirection}};
+}
+
+struct ScenePlayer {
+    std::string skinPath;
+    glm::vec3 position;
+    float yaw;  // degrees around the up axis
+};
+
+// One "player <skin.png> <x> <y> <z> [yaw]" line per player, other lines are ignored.
+std::vector<ScenePlayer> LoadScene(std::string filename) {
+    std::ifstream input(filename, std::ios::in);
+    std::vector<ScenePlayer> ret;
+    if (!input.is_open()) {
+        std::cerr << "ERROR: Cannot open scene file \'" << filename << "\'." << std::endl;
+        exit(-1);
+    }
+    std::string line;
+    while (std::getline(input, line)) {
+        std::istringstream fields(line);
+        std::string token;
+        fields >> token;
+        if (token != "player") continue;
+        ScenePlayer player;
+        fields >> player.skinPath;
+        player.position = ReadVec3(fields);
+        if (fields.fail()) {
+            std::cerr << "ERROR: Malformed scene line \'" << line << "\'." << std::endl;
+            exit(-1);
+        }
+        if (!(fields >> player.yaw)) player.yaw = 0.0f;
+        ret.push_back(player);
+    }
+    if (ret.empty()) {
+        std::cerr << "ERROR: Scene file \'" << filename << "\' has no players." << std::endl;
+        exit(-1);
+    }
+    return ret;
+}
+
+// Rotation of every part around its pivot as Euler angles in degrees, applied X first, then Y, then Z. Parts missing
+// from the map stay in their rest pose. Parts turn independently of each other, there is no bone hierarchy.
+struct ModelPose {
+    std::map<std::string, glm::vec3> rotations;
+};
+
+// Shoulders sit two units below the top of the arm boxes, every other part turns around its own origin (neck, hips,
+// center of the body).
+glm::vec3 GetPartPivot(const ModelConfig &config, const std::string &part) {
+    auto iterator = config.pivots.find(part);
+    if (iterator != config.pivots.end()) return iterator->second;
+    if (part == "LeftArm") return glm::vec3(2.0f, -2.0f, 0.0f);
+    if (part == "RightArm") return glm::vec3(-2.0f, -2.0f, 0.0f);
+    return glm::vec3(0.0f, 0.0f, 0.0f);
+}
+
+// Part space to model space: attachment scale, posed rotation around the pivot, then the move to the part's origin.
+glm::mat4 GetPartMatrix(ModelConfig &config, const ModelPose &pose, const std::string &part, bool attachment) {
+    glm::mat4 transformMatrix = glm::translate(glm::mat4(1.0f), config.origins[part]);
+    auto rotation = pose.rotations.find(part);
+    if (rotation != pose.rotations.end()) {
+        glm::vec3 pivot = GetPartPivot(config, part);
+        transformMatrix = glm::translate(transformMatrix, pivot);
+        transformMatrix = glm::rotate(transformMatrix, glm::radians(rotation->second.z), glm::vec3(0.0f, 0.0f, 1.0f));
+        transformMatrix = glm::rotate(transformMatrix, glm::radians(rotation->second.y), glm::vec3(0.0f, 1.0f, 0.0f));
+        transformMatrix = glm::rotate(transformMatrix, glm::radians(rotation->second.x), glm::vec3(1.0f, 0.0f, 0.0f));
+        transformMatrix = glm::translate(transformMatrix, -pivot);
+    }
+    if (attachment) {
+        float scale = config.attachmentScales[part];
+        transformMatrix = glm::scale(transformMatrix, glm::vec3(scale, scale, scale));
+    }
+    return transformMatrix;
+}
+
+struct ModelVertex {
+    glm::vec4 position;
+    glm::vec2 textureCoord;
+};
+
+// Quads in triangle fan order, four vertices per face, already posed and moved to their origins.
+struct ModelGeometry {
+    std::vector<ModelVertex> baseVertices;
+    std::vector<ModelVertex> attachmentVertices;
+};
+
+ModelGeometry BuildModelGeometry(std::map<std::string, ObjModel> &models, ModelConfig &config,
+                                 const ModelPose &pose = ModelPose()) {
+    ModelGeometry geometry;
+    for (auto &object : models) {
+        const std::string &name = object.first;
+        if (name.find("Attachment") != std::string::npos) continue;
+        glm::mat4 transformMatrix = GetPartMatrix(config, pose, name, false);
+        for (auto &face : object.second.faces) {
+            for (size_t i = 0; i < 4; ++i) {
+                ModelVertex vertex;
+                vertex.position = transformMatrix * object.second.vertices[face.element[i].vertexIndex - 1];
+                vertex.textureCoord = object.second.textureCoords[face.element[i].textureCoordIndex - 1];
+                geometry.baseVertices.push_back(vertex);
+            }
+        }
+    }
+    for (auto &object : models) {
+        const std::string &name = object.first;
+        if (name.find("Attachment") == std::string::npos) continue;
+        std::string refName = name.substr(0, name.find("Attachment"));
+        ObjModel &objectRef = models[refName];
+        glm::mat4 transformMatrix = GetPartMatrix(config, pose, refName, true);
+        for (auto &face : objectRef.faces) {
+            for (size_t i = 0; i < 4; ++i) {
+                ModelVertex vertex;
+                vertex.position = transformMatrix * objectRef.vertices[face.element[i].vertexIndex - 1];
+                vertex.textureCoord = object.second.textureCoords[face.element[i].textureCoordIndex - 1];
+                geometry.attachmentVertices.push_back(vertex);
+            }
+        }
+    }
+    return geometry;
+}
+
+// Compact GPU vertex: 10 bytes instead of 24. Positions are model space in half units and are moved into place by the
+// part's matrix in model_vertex_shader.glsl, texture coordinates are texels of the 64x64 layout. Posing only changes
+// the part matrices, the vertices stay as they are. The fields take 9 bytes; the explicit padding byte is the one the
+// compiler would add anyway to keep the shorts of the next vertex 2 byte aligned, named so it is uploaded as zero
+// instead of indeterminate. Positions and texture coordinates use their full range, leaving no spare bits for 'part'.
+struct PackedModelVertex {
+    short position[3];
+    unsigned char textureCoord[2];
+    unsigned char part;  // index into PackedModelGeometry::partMatrices
+    unsigned char padding;
+};
+
+static_assert(sizeof(PackedModelVertex) == 10, "packed vertices are uploaded with a 10 byte stride");
+
+const size_t maxPackedModelParts = 16;  // size of the partMatrices uniform array
+
+struct PackedModelPart {
+    std::string name;
+    bool attachment;
+};
+
+struct PackedModelGeometry {
+    std::vector<PackedModelVertex> baseVertices;
+    std::vector<PackedModelVertex> attachmentVertices;
+    std::vector<PackedModelPart> parts;
+    std::vector<glm::mat4> partMatrices;  // origin, pose, attachment scale and the half unit scale
+};
+
+std::vector<glm::mat4> GetPackedPartMatrices(const std::vector<PackedModelPart> &parts, ModelConfig &config,
+                                             const ModelPose &pose) {
+    std::vector<glm::mat4> partMatrices;
+    for (auto &part : parts) {
+        glm::mat4 partMatrix = GetPartMatrix(config, pose, part.name, part.attachment);
+        partMatrices.push_back(glm::scale(partMatrix, glm::vec3(0.5f, 0.5f, 0.5f)));
+    }
+    return partMatrices;
+}
+
+inline bool PackModelVertex(const glm::vec4 &position, const glm::vec2 &textureCoord, size_t part,
+                            PackedModelVertex &vertex) {
+    for (size_t axis = 0; axis < 3; ++axis) {
+        float halfUnits = position[axis] * 2.0f;
+        if (halfUnits != std::round(halfUnits) || std::fabs(halfUnits) > 32767.0f) return false;
+        vertex.position[axis] = static_cast<short>(halfUnits);
+    }
+    for (size_t axis = 0; axis < 2; ++axis) {
+        float texel = textureCoord[axis] * 64.0f;
+        if (texel != std::round(texel) || texel < 0.0f || texel > 255.0f) return false;
+        vertex.textureCoord[axis] = static_cast<unsigned char>(texel);
+    }
+    vertex.part = static_cast<unsigned char>(part);
+    vertex.padding = 0;
+    return true;
+}
+
+// Same faces and order as BuildModelGeometry. Returns false when the model is off the half unit or texel grid.
+bool BuildPackedModelGeometry(std::map<std::string, ObjModel> &models, ModelConfig &config,
+                              PackedModelGeometry &geometry, const ModelPose &pose = ModelPose()) {
+    for (int attachmentPass = 0; attachmentPass < 2; ++attachmentPass) {
+        for (auto &object : models) {
+            const std::string &name = object.first;
+            bool isAttachment = name.find("Attachment") != std::string::npos;
+            if (isAttachment != (attachmentPass == 1)) continue;
+            std::string refName = isAttachment ? name.substr(0, name.find("Attachment")) : name;
+            ObjModel &objectRef = models[refName];
+            size_t part = geometry.parts.size();
+            if (part >= maxPackedModelParts) return false;
+            geometry.parts.push_back(PackedModelPart{refName, isAttachment});
+            std::vector<PackedModelVertex> &vertices = isAttachment ? geometry.attachmentVertices : geometry.baseVertices;
+            for (auto &face : objectRef.faces) {
+                for (size_t i = 0; i < 4; ++i) {
+                    PackedModelVertex vertex;
+                    if (!PackModelVertex(objectRef.vertices[face.element[i].vertexIndex - 1],
+                                         object.second.textureCoords[face.element[i].textureCoordIndex - 1], part,
+                                         vertex)) {
+                        return false;
+                    }
+                    vertices.push_back(vertex);
+                }
+            }
+        }
+    }
+    geometry.partMatrices = GetPackedPartMatrices(geometry.parts, config, pose);
+    return true;
+}
@@ -0,0 +1,123 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Keyframed poses. An animation covers the time range [0, 1) and loops; a single keyframe is a still pose. pose= names
+// one of the presets below or a pose file.
+
+struct PoseKeyframe {
+    float time;
+    ModelPose pose;
+};
+
+const std::map<std::string, std::vector<PoseKeyframe>> &GetPosePresets() {
+    static const ModelPose walkingPose = {{{"LeftArm", glm::vec3(30.0f, 0.0f, 0.0f)},
+                                           {"RightArm", glm::vec3(-30.0f, 0.0f, 0.0f)},
+                                           {"LeftLeg", glm::vec3(-30.0f, 0.0f, 0.0f)},
+                                           {"RightLeg", glm::vec3(30.0f, 0.0f, 0.0f)}}};
+    static const ModelPose walkingMirrored = {{{"LeftArm", glm::vec3(-30.0f, 0.0f, 0.0f)},
+                                               {"RightArm", glm::vec3(30.0f, 0.0f, 0.0f)},
+                                               {"LeftLeg", glm::vec3(30.0f, 0.0f, 0.0f)},
+                                               {"RightLeg", glm::vec3(-30.0f, 0.0f, 0.0f)}}};
+    static const ModelPose wavingUp = {{{"RightArm", glm::vec3(0.0f, 0.0f, -160.0f)}}};
+    static const ModelPose wavingOut = {{{"RightArm", glm::vec3(0.0f, 0.0f, -120.0f)}}};
+    static const ModelPose sittingPose = {{{"LeftArm", glm::vec3(-36.0f, 0.0f, 0.0f)},
+                                           {"RightArm", glm::vec3(-36.0f, 0.0f, 0.0f)},
+                                           {"LeftLeg", glm::vec3(-90.0f, -18.0f, 0.0f)},
+                                           {"RightLeg", glm::vec3(-90.0f, 18.0f, 0.0f)}}};
+    static const std::map<std::string, std::vector<PoseKeyframe>> presets = {
+        {"standing", {{0.0f, ModelPose()}}},
+        {"walking", {{0.0f, walkingPose}, {0.5f, walkingMirrored}, {1.0f, walkingPose}}},
+        {"waving", {{0.0f, wavingUp}, {0.5f, wavingOut}, {1.0f, wavingUp}}},
+        {"sitting", {{0.0f, sittingPose}}},
+    };
+    return presets;
+}
+
+// One "<time> <part> <x> <y> <z>" line per rotation, e.g. "0.5 LeftArm -30 0 0". Rotations sharing a time form one
+// keyframe. Empty lines and lines starting with '#' are skipped.
+std::vector<PoseKeyframe> LoadPoseAnimation(const std::string &filename) {
+    std::ifstream input(filename, std::ios::in);
+    if (!input.is_open()) {
+        std::cerr << "ERROR: Unknown pose \'" << filename << "\', expected a pose file or one of:";
+        for (auto &preset : GetPosePresets()) {
+            std::cerr << ' ' << preset.first;
+        }
+        std::cerr << std::endl;
+        exit(-1);
+    }
+    std::map<float, ModelPose> keyframes;
+    std::string line;
+    while (std::getline(input, line)) {
+        std::istringstream fields(line);
+        float time;
+        std::string part;
+        if (!(fields >> time)) {
+            fields.clear();
+            fields.seekg(0);
+            std::string token;
+            if (!(fields >> token) || token[0] == '#') continue;
+            std::cerr << "ERROR: Malformed pose line \'" << line << "\'." << std::endl;
+            exit(-1);
+        }
+        fields >> part;
+        glm::vec3 rotation = ReadVec3(fields);
+        if (fields.fail()) {
+            std::cerr << "ERROR: Malformed pose line \'" << line << "\'." << std::endl;
+            exit(-1);
+        }
+        keyframes[time].rotations[part] = rotation;
+    }
+    if (keyframes.empty()) {
+        std::cerr << "ERROR: Pose file \'" << filename << "\' has no keyframes." << std::endl;
+        exit(-1);
+    }
+    std::vector<PoseKeyframe> ret;
+    for (auto &keyframe : keyframes) {
+        ret.push_back(PoseKeyframe{keyframe.first, keyframe.second});
+    }
+    return ret;
+}
+
+// Linear interpolation of the angles between the keyframes around 'time', which wraps into [0, 1). Before the first
+// and after the last keyframe the pose holds.
+ModelPose EvaluatePoseAnimation(const std::vector<PoseKeyframe> &keyframes, float time) {
+    time -= std::floor(time);
+    auto next = std::upper_bound(keyframes.begin(), keyframes.end(), time,
+                                 [](float value, const PoseKeyframe &keyframe) { return value < keyframe.time; });
+    if (next == keyframes.begin()) return next->pose;
+    if (next == keyframes.end()) return keyframes.back().pose;
+    const PoseKeyframe &previous = *(next - 1);
+    float weight = (time - previous.time) / (next->time - previous.time);
+    ModelPose ret = previous.pose;
+    for (auto &rotation : next->pose.rotations) {
+        // parts only the next keyframe rotates start from the rest pose
+        ret.rotations.insert(std::make_pair(rotation.first, glm::vec3(0.0f, 0.0f, 0.0f)));
+    }
+    for (auto &rotation : ret.rotations) {
+        auto target = next->pose.rotations.find(rotation.first);
+        glm::vec3 to = target == next->pose.rotations.end() ? glm::vec3(0.0f, 0.0f, 0.0f) : target->second;
+        rotation.second += (to - rotation.second) * weight;
+    }
+    return ret;
+}
+
+const std::vector<PoseKeyframe> &GetSelectedPoseAnimation() {
+    static std::vector<PoseKeyframe> keyframes;
+    if (keyframes.empty()) {
+        auto &presets = GetPosePresets();
+        auto preset = presets.find(Global::pose.empty() ? "standing" : Global::pose);
+        keyframes = preset != presets.end() ? preset->second : LoadPoseAnimation(Global::pose);
+    }
+    return keyframes;
+}
+
+// The pose= animation at poseTime= plus 'offset'.
+ModelPose GetSelectedPose(float offset = 0.0f) {
+    return EvaluatePoseAnimation(GetSelectedPoseAnimation(), Global::poseTime + offset);
+}
@@ -0,0 +1,276 @@
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Software implementation of the model pass for backend=cpu. It follows model_vertex_shader.glsl and
+// model_fragment_shader.glsl: perspective transform, near/far clipping, GL_LESS depth test, perspective correct
+// GL_NEAREST/GL_REPEAT texture fetch, the disableTransparent/upscaleRGBA discard rules and alpha blending of the
+// attachment layer. Triangles are binned into tiles and coverage is evaluated four pixels at a time.
+
+const int rasterTileSize = 32;
+
+struct ClipVertex {
+    glm::vec4 position;
+    glm::vec2 textureCoord;
+};
+
+struct RasterTriangle {
+    float edgeA[3], edgeB[3], edgeC[3];
+    bool topLeft[3];
+    float inverseArea;
+    float depth[3];
+    float inverseW[3];
+    float uOverW[3];
+    float vOverW[3];
+    int minX, minY, maxX, maxY;
+    bool attachment;
+};
+
+struct RasterTarget {
+    unsigned int width;
+    unsigned int height;
+    std::vector<unsigned char> color;  // RGBA, bottom-up like the GL framebuffer
+    std::vector<float> depth;
+};
+
+// Sutherland-Hodgman against the plane dot(plane, position) >= 0 in clip space.
+std::vector<ClipVertex> ClipPolygon(const std::vector<ClipVertex> &polygon, const glm::vec4 &plane) {
+    std::vector<ClipVertex> result;
+    for (size_t index = 0; index < polygon.size(); ++index) {
+        const ClipVertex &current = polygon[index];
+        const ClipVertex &next = polygon[(index + 1) % polygon.size()];
+        float currentDistance = glm::dot(plane, current.position);
+        float nextDistance = glm::dot(plane, next.position);
+        if (currentDistance >= 0.0f) result.push_back(current);
+        if ((currentDistance >= 0.0f) != (nextDistance >= 0.0f)) {
+            float factor = currentDistance / (currentDistance - nextDistance);
+            ClipVertex vertex;
+            vertex.position = glm::mix(current.position, next.position, factor);
+            vertex.textureCoord = glm::mix(current.textureCoord, next.textureCoord, factor);
+            result.push_back(vertex);
+        }
+    }
+    return result;
+}
+
+bool SetupTriangle(const ClipVertex &vertex0, const ClipVertex &vertex1, const ClipVertex &vertex2,
+                   const RasterTarget &target, bool attachment, RasterTriangle &triangle) {
+    const ClipVertex *vertices[3] = {&vertex0, &vertex1, &vertex2};
+    float X[3], Y[3];
+    for (size_t index = 0; index < 3; ++index) {
+        const glm::vec4 &position = vertices[index]->position;
+        float inverseW = 1.0f / position.w;
+        X[index] = (position.x * inverseW + 1.0f) * 0.5f * target.width;
+        Y[index] = (position.y * inverseW + 1.0f) * 0.5f * target.height;
+        triangle.depth[index] = (position.z * inverseW + 1.0f) * 0.5f;
+        triangle.inverseW[index] = inverseW;
+        triangle.uOverW[index] = vertices[index]->textureCoord.x * inverseW;
+        triangle.vOverW[index] = vertices[index]->textureCoord.y * inverseW;
+    }
+    // edge k is opposite to vertex k, E(p) = A * p.x + B * p.y + C, computed so that a shared edge of two
+    // triangles yields exactly negated values and the top-left rule keeps the mesh watertight
+    float area = 0.0f;
+    for (size_t edge = 0; edge < 3; ++edge) {
+        size_t from = (edge + 1) % 3, to = (edge + 2) % 3;
+        triangle.edgeA[edge] = Y[from] - Y[to];
+        triangle.edgeB[edge] = X[to] - X[from];
+        triangle.edgeC[edge] = X[from] * Y[to] - X[to] * Y[from];
+        area += triangle.edgeC[edge];
+    }
+    if (area == 0.0f || std::isnan(area)) return false;
+    // counter-clockwise is front facing; base boxes are closed and opaque, so their back faces are culled like in GL
+    if (area < 0.0f && !attachment) return false;
+    if (area < 0.0f) {
+        for (size_t edge = 0; edge < 3; ++edge) {
+            triangle.edgeA[edge] = -triangle.edgeA[edge];
+            triangle.edgeB[edge] = -triangle.edgeB[edge];
+            triangle.edgeC[edge] = -triangle.edgeC[edge];
+        }
+        area = -area;
+    }
+    for (size_t edge = 0; edge < 3; ++edge) {
+        triangle.topLeft[edge] =
+            triangle.edgeA[edge] > 0.0f || (triangle.edgeA[edge] == 0.0f && triangle.edgeB[edge] < 0.0f);
+    }
+    triangle.inverseArea = 1.0f / area;
+    triangle.minX = std::max(0, static_cast<int>(std::floor(std::min({X[0], X[1], X[2]}))));
+    triangle.minY = std::max(0, static_cast<int>(std::floor(std::min({Y[0], Y[1], Y[2]}))));
+    triangle.maxX = std::min(static_cast<int>(target.width) - 1, static_cast<int>(std::ceil(std::max({X[0], X[1], X[2]}))));
+    triangle.maxY =
+        std::min(static_cast<int>(target.height) - 1, static_cast<int>(std::ceil(std::max({Y[0], Y[1], Y[2]}))));
+    triangle.attachment = attachment;
+    return triangle.minX <= triangle.maxX && triangle.minY <= triangle.maxY;
+}
+
+void SetupFaces(const std::vector<ModelVertex> &vertices, const glm::mat4 &transformMatrix, const RasterTarget &target,
+                bool attachment, std::vector<RasterTriangle> &triangles) {
+    const glm::vec4 nearPlane(0.0f, 0.0f, 1.0f, 1.0f), farPlane(0.0f, 0.0f, -1.0f, 1.0f);
+    for (size_t faceStart = 0; faceStart + 4 <= vertices.size(); faceStart += 4) {
+        std::vector<ClipVertex> polygon(4);
+        for (size_t index = 0; index < 4; ++index) {
+            polygon[index].position = transformMatrix * vertices[faceStart + index].position;
+            polygon[index].textureCoord = vertices[faceStart + index].textureCoord;
+        }
+        polygon = ClipPolygon(ClipPolygon(polygon, nearPlane), farPlane);
+        // triangle fan, like GL_TRIANGLE_FAN
+        for (size_t index = 1; index + 1 < polygon.size(); ++index) {
+            RasterTriangle triangle;
+            if (SetupTriangle(polygon[0], polygon[index], polygon[index + 1], target, attachment, triangle)) {
+                triangles.push_back(triangle);
+            }
+        }
+    }
+}
+
+inline float InterpolateDepth(const RasterTriangle &triangle, float lambda0, float lambda1, float lambda2) {
+    return lambda0 * triangle.depth[0] + lambda1 * triangle.depth[1] + lambda2 * triangle.depth[2];
+}
+
+inline glm::vec2 InterpolateTextureCoord(const RasterTriangle &triangle, float lambda0, float lambda1, float lambda2) {
+    float inverseW =
+        lambda0 * triangle.inverseW[0] + lambda1 * triangle.inverseW[1] + lambda2 * triangle.inverseW[2];
+    float u = (lambda0 * triangle.uOverW[0] + lambda1 * triangle.uOverW[1] + lambda2 * triangle.uOverW[2]) / inverseW;
+    float v = (lambda0 * triangle.vOverW[0] + lambda1 * triangle.vOverW[1] + lambda2 * triangle.vOverW[2]) / inverseW;
+    return glm::vec2(u, v);
+}
+
+inline void ShadeFragment(const RasterTriangle &triangle, const ImageData &texture, bool upscaleRGBA,
+                          RasterTarget &target, unsigned int X, unsigned int Y, float lambda0, float lambda1,
+                          float lambda2) {
+    size_t pixelId = static_cast<size_t>(Y) * target.width + X;
+    float depth = InterpolateDepth(triangle, lambda0, lambda1, lambda2);
+    if (!(depth < target.depth[pixelId])) return;
+    glm::vec2 textureCoord = InterpolateTextureCoord(triangle, lambda0, lambda1, lambda2);
+    float u = textureCoord.x, v = textureCoord.y;
+    int texelX = static_cast<int>(std::floor(u * texture.width)) % static_cast<int>(texture.width);
+    int texelY = static_cast<int>(std::floor(v * texture.height)) % static_cast<int>(texture.height);
+    if (texelX < 0) texelX += texture.width;
+    if (texelY < 0) texelY += texture.height;
+    const unsigned char *texel = &texture.data[(static_cast<size_t>(texelY) * texture.width + texelX) * 4];
+
+    unsigned char color[4] = {texel[0], texel[1], texel[2], texel[3]};
+    bool disableTransparent = !triangle.attachment;
+    if (!disableTransparent && color[3] != 255) {
+        return;
+    } else if (upscaleRGBA && !disableTransparent && color[0] == 0 && color[1] == 0 && color[2] == 0) {
+        return;
+    } else if (disableTransparent && color[3] != 255) {
+        color[0] = color[1] = color[2] = 0;
+        color[3] = 255;
+    }
+    unsigned char *destination = &target.color[pixelId * 4];
+    if (triangle.attachment) {
+        // glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA)
+        unsigned int alpha = color[3], inverseAlpha = 255 - alpha;
+        for (size_t channel = 0; channel < 3; ++channel) {
+            destination[channel] =
+                static_cast<unsigned char>((color[channel] * alpha + destination[channel] * inverseAlpha + 127) / 255);
+        }
+        destination[3] = static_cast<unsigned char>(alpha + (destination[3] * inverseAlpha + 127) / 255);
+    } else {
+        std::memcpy(destination, color, 4);
+    }
+    target.depth[pixelId] = depth;
+}
+
+// Calls fragment(X, Y, lambda0, lambda1, lambda2) for every covered pixel of the triangle inside the tile.
+template <typename FragmentFunction>
+void RasterizeTriangleInTile(const RasterTriangle &triangle, int tileX, int tileY, FragmentFunction fragment) {
+    int minX = std::max(triangle.minX, tileX), maxX = std::min(triangle.maxX, tileX + rasterTileSize - 1);
+    int minY = std::max(triangle.minY, tileY), maxY = std::min(triangle.maxY, tileY + rasterTileSize - 1);
+    for (int Y = minY; Y <= maxY; ++Y) {
+        float centerY = Y + 0.5f;
+        for (int X = minX; X <= maxX; X += 4) {
+            float edge[3][4];
+            int mask = 0;
+#ifdef __SSE2__
+            __m128 centerX = _mm_add_ps(_mm_set1_ps(X + 0.5f), _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f));
+            __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+            for (size_t index = 0; index < 3; ++index) {
+                __m128 value = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(triangle.edgeA[index]), centerX),
+                                                     _mm_set1_ps(triangle.edgeB[index] * centerY)),
+                                          _mm_set1_ps(triangle.edgeC[index]));
+                __m128 test = triangle.topLeft[index] ? _mm_cmpge_ps(value, _mm_setzero_ps())
+                                                      : _mm_cmpgt_ps(value, _mm_setzero_ps());
+                inside = _mm_and_ps(inside, test);
+                _mm_storeu_ps(edge[index], value);
+            }
+            mask = _mm_movemask_ps(inside);
+#else
+            for (int lane = 0; lane < 4; ++lane) {
+                float centerX = X + lane + 0.5f;
+                bool inside = true;
+                for (size_t index = 0; index < 3; ++index) {
+                    float value = (triangle.edgeA[index] * centerX + triangle.edgeB[index] * centerY) +
+                                  triangle.edgeC[index];
+                    inside = inside && (triangle.topLeft[index] ? value >= 0.0f : value > 0.0f);
+                    edge[index][lane] = value;
+                }
+                mask |= inside ? 1 << lane : 0;
+            }
+#endif
+            if (X + 4 > maxX + 1) mask &= (1 << (maxX + 1 - X)) - 1;
+            for (int lane = 0; mask != 0; ++lane, mask >>= 1) {
+                if (!(mask & 1)) continue;
+                fragment(X + lane, Y, edge[0][lane] * triangle.inverseArea, edge[1][lane] * triangle.inverseArea,
+                         edge[2][lane] * triangle.inverseArea);
+            }
+        }
+    }
+}
+
+// Renders the model layer (straight alpha RGBA, transparent where nothing was drawn) without any GL context.
+ImageData RasterizeModel(const ModelGeometry &geometry, const ImageData &texture, const glm::mat4 &viewMatrix,
+                         const glm::mat4 &projectMatrix, unsigned int width, unsigned int height) {
+    RasterTarget target;
+    target.width = width;
+    target.height = height;
+    target.color.assign(static_cast<size_t>(width) * height * 4, 0);
+    target.depth.assign(static_cast<size_t>(width) * height, 1.0f);
+
+    glm::mat4 transformMatrix = projectMatrix * viewMatrix;
+    std::vector<RasterTriangle> triangles;
+    SetupFaces(geometry.baseVertices, transformMatrix, target, false, triangles);
+    SetupFaces(geometry.attachmentVertices, transformMatrix, target, true, triangles);
+
+    // bin triangles into tiles, keeping submission order so depth ties and blending match GL
+    int tileColumns = (width + rasterTileSize - 1) / rasterTileSize;
+    int tileRows = (height + rasterTileSize - 1) / rasterTileSize;
+    std::vector<std::vector<unsigned int>> bins(tileColumns * tileRows);
+    for (unsigned int triangleId = 0; triangleId < triangles.size(); ++triangleId) {
+        const RasterTriangle &triangle = triangles[triangleId];
+        for (int tileY = triangle.minY / rasterTileSize; tileY <= triangle.maxY / rasterTileSize; ++tileY) {
+            for (int tileX = triangle.minX / rasterTileSize; tileX <= triangle.maxX / rasterTileSize; ++tileX) {
+                bins[tileY * tileColumns + tileX].push_back(triangleId);
+            }
+        }
+    }
+    for (int tileY = 0; tileY < tileRows; ++tileY) {
+        for (int tileX = 0; tileX < tileColumns; ++tileX) {
+            for (unsigned int triangleId : bins[tileY * tileColumns + tileX]) {
+                const RasterTriangle &triangle = triangles[triangleId];
+                RasterizeTriangleInTile(triangle, tileX * rasterTileSize, tileY * rasterTileSize,
+                                        [&](unsigned int X, unsigned int Y, float lambda0, float lambda1, float lambda2) {
+                                            ShadeFragment(triangle, texture, texture.upscaleRGBA, target, X, Y,
+                                                          lambda0, lambda1, lambda2);
+                                        });
+            }
+        }
+    }
+
+    ImageData layer;
+    layer.width = width;
+    layer.height = height;
+    layer.bytePerPixel = 4;
+    layer.upscaleRGBA = false;
+    layer.data = new unsigned char[target.color.size()];
+    std::memcpy(layer.data, target.color.data(), target.color.size());
+    return layer;
+}
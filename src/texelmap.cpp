@@ -0,0 +1,397 @@
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// Texel maps: for a fixed camera, frame size and model every screen pixel always shows the same skin texels, only
+// their colors change between skins. A map stores per pixel the nearest texel reference and, for pixels whose nearest
+// fragment comes from the attachment layer, the farther references to fall back on when that texel is transparent.
+// Rendering a skin through a map is a single gather-and-resolve loop over the frame.
+
+enum TexelLayer : unsigned char { TexelLayerNone = 0, TexelLayerBase = 1, TexelLayerAttachment = 2 };
+
+struct TexelReference {
+    unsigned short u;  // texture coordinate in 1/65536 units, wrapped like GL_REPEAT
+    unsigned short v;
+    unsigned char layer;
+};
+
+static_assert(sizeof(TexelReference) == 6, "texel references are gathered with a 6 byte stride");
+
+struct TexelMap {
+    unsigned int width;
+    unsigned int height;
+    std::vector<TexelReference> primary;
+    std::vector<unsigned int> fallbackStart;  // width * height + 1 offsets into fallbacks
+    std::vector<TexelReference> fallbacks;
+};
+
+struct TexelCandidate {
+    float depth;
+    TexelReference reference;
+};
+
+// Collects fragments per pixel, sorted near to far and cut after the first (always opaque) base fragment.
+struct TexelMapBuilder {
+    unsigned int width;
+    unsigned int height;
+    std::vector<std::vector<TexelCandidate>> candidates;
+};
+
+inline unsigned short EncodeTextureCoord(float value) {
+    float wrapped = value - std::floor(value);
+    int encoded = static_cast<int>(wrapped * 65536.0f);
+    return static_cast<unsigned short>(std::min(std::max(encoded, 0), 65535));
+}
+
+TexelMapBuilder CreateTexelMapBuilder(unsigned int width, unsigned int height) {
+    TexelMapBuilder builder;
+    builder.width = width;
+    builder.height = height;
+    builder.candidates.resize(static_cast<size_t>(width) * height);
+    return builder;
+}
+
+void AddTexelCandidate(TexelMapBuilder &builder, size_t pixelId, float depth, const glm::vec2 &textureCoord,
+                       TexelLayer layer) {
+    std::vector<TexelCandidate> &list = builder.candidates[pixelId];
+    auto position = std::upper_bound(list.begin(), list.end(), depth,
+                                     [](float value, const TexelCandidate &entry) { return value < entry.depth; });
+    // anything behind a base fragment can never show up
+    for (auto iterator = list.begin(); iterator != position; ++iterator) {
+        if (iterator->reference.layer == TexelLayerBase) return;
+    }
+    TexelCandidate candidate;
+    candidate.depth = depth;
+    candidate.reference.u = EncodeTextureCoord(textureCoord.x);
+    candidate.reference.v = EncodeTextureCoord(textureCoord.y);
+    candidate.reference.layer = layer;
+    position = list.insert(position, candidate);
+    if (layer == TexelLayerBase) list.erase(position + 1, list.end());
+}
+
+TexelMap FinishTexelMap(const TexelMapBuilder &builder) {
+    TexelMap map;
+    map.width = builder.width;
+    map.height = builder.height;
+    size_t pixelCount = builder.candidates.size();
+    map.primary.resize(pixelCount);
+    map.fallbackStart.resize(pixelCount + 1);
+    for (size_t pixelId = 0; pixelId < pixelCount; ++pixelId) {
+        const std::vector<TexelCandidate> &list = builder.candidates[pixelId];
+        map.fallbackStart[pixelId] = map.fallbacks.size();
+        if (list.empty()) {
+            map.primary[pixelId] = TexelReference{0, 0, TexelLayerNone};
+            continue;
+        }
+        map.primary[pixelId] = list[0].reference;
+        for (size_t index = 1; index < list.size(); ++index) {
+            map.fallbacks.push_back(list[index].reference);
+        }
+    }
+    map.fallbackStart[pixelCount] = map.fallbacks.size();
+    return map;
+}
+
+// Orthographic cameras: every face is a parallelogram on screen and texture coordinates and depth are affine over it,
+// so each face is scanned directly through its inverse affine map. Faces are visited back to front (painter order),
+// which keeps most candidate insertions at the front of the per-pixel lists.
+TexelMap BuildIsometricTexelMap(const ModelGeometry &geometry, const glm::mat4 &transformMatrix, unsigned int width,
+                                unsigned int height) {
+    struct ScreenFace {
+        glm::vec3 corner[4];
+        glm::vec2 textureCoord[4];
+        TexelLayer layer;
+        float centerDepth;
+    };
+    std::vector<ScreenFace> faces;
+    const std::vector<ModelVertex> *layers[2] = {&geometry.baseVertices, &geometry.attachmentVertices};
+    for (size_t layerId = 0; layerId < 2; ++layerId) {
+        const std::vector<ModelVertex> &vertices = *layers[layerId];
+        for (size_t faceStart = 0; faceStart + 4 <= vertices.size(); faceStart += 4) {
+            ScreenFace face;
+            face.layer = layerId == 0 ? TexelLayerBase : TexelLayerAttachment;
+            face.centerDepth = 0.0f;
+            for (size_t index = 0; index < 4; ++index) {
+                glm::vec4 position = transformMatrix * vertices[faceStart + index].position;
+                face.corner[index] = glm::vec3((position.x / position.w + 1.0f) * 0.5f * width,
+                                               (position.y / position.w + 1.0f) * 0.5f * height,
+                                               (position.z / position.w + 1.0f) * 0.5f);
+                face.textureCoord[index] = vertices[faceStart + index].textureCoord;
+                face.centerDepth += face.corner[index].z * 0.25f;
+            }
+            faces.push_back(face);
+        }
+    }
+    std::stable_sort(faces.begin(), faces.end(),
+                     [](const ScreenFace &left, const ScreenFace &right) { return left.centerDepth > right.centerDepth; });
+
+    TexelMapBuilder builder = CreateTexelMapBuilder(width, height);
+    for (const ScreenFace &face : faces) {
+        // corner = corner[0] + s * (corner[1] - corner[0]) + t * (corner[3] - corner[0])
+        glm::vec3 edgeS = face.corner[1] - face.corner[0];
+        glm::vec3 edgeT = face.corner[3] - face.corner[0];
+        float determinant = edgeS.x * edgeT.y - edgeS.y * edgeT.x;
+        if (std::fabs(determinant) < 1e-6f) continue;  // seen edge-on
+        if (determinant < 0.0f && face.layer == TexelLayerBase) continue;  // back face of a closed opaque box
+        float minX = face.corner[0].x, maxX = minX, minY = face.corner[0].y, maxY = minY;
+        for (size_t index = 1; index < 4; ++index) {
+            minX = std::min(minX, face.corner[index].x);
+            maxX = std::max(maxX, face.corner[index].x);
+            minY = std::min(minY, face.corner[index].y);
+            maxY = std::max(maxY, face.corner[index].y);
+        }
+        int beginX = std::max(0, static_cast<int>(std::floor(minX)));
+        int endX = std::min(static_cast<int>(width) - 1, static_cast<int>(std::ceil(maxX)));
+        int beginY = std::max(0, static_cast<int>(std::floor(minY)));
+        int endY = std::min(static_cast<int>(height) - 1, static_cast<int>(std::ceil(maxY)));
+        for (int Y = beginY; Y <= endY; ++Y) {
+            for (int X = beginX; X <= endX; ++X) {
+                float offsetX = X + 0.5f - face.corner[0].x;
+                float offsetY = Y + 0.5f - face.corner[0].y;
+                float s = (offsetX * edgeT.y - offsetY * edgeT.x) / determinant;
+                float t = (edgeS.x * offsetY - edgeS.y * offsetX) / determinant;
+                if (s < 0.0f || s >= 1.0f || t < 0.0f || t >= 1.0f) continue;
+                float depth = face.corner[0].z + s * edgeS.z + t * edgeT.z;
+                if (depth < 0.0f || depth > 1.0f) continue;
+                glm::vec2 textureCoord = face.textureCoord[0] + s * (face.textureCoord[1] - face.textureCoord[0]) +
+                                         t * (face.textureCoord[3] - face.textureCoord[0]);
+                AddTexelCandidate(builder, static_cast<size_t>(Y) * width + X, depth, textureCoord, face.layer);
+            }
+        }
+    }
+    return FinishTexelMap(builder);
+}
+
+// Any camera: rasterizes a G-buffer of texture coordinates with the software rasterizer's coverage rules, keeping
+// every fragment in front of the nearest base fragment.
+TexelMap BuildPerspectiveTexelMap(const ModelGeometry &geometry, const glm::mat4 &transformMatrix, unsigned int width,
+                                  unsigned int height) {
+    RasterTarget target;
+    target.width = width;
+    target.height = height;
+    std::vector<RasterTriangle> triangles;
+    SetupFaces(geometry.baseVertices, transformMatrix, target, false, triangles);
+    SetupFaces(geometry.attachmentVertices, transformMatrix, target, true, triangles);
+
+    TexelMapBuilder builder = CreateTexelMapBuilder(width, height);
+    for (const RasterTriangle &triangle : triangles) {
+        TexelLayer layer = triangle.attachment ? TexelLayerAttachment : TexelLayerBase;
+        for (int tileY = triangle.minY / rasterTileSize; tileY <= triangle.maxY / rasterTileSize; ++tileY) {
+            for (int tileX = triangle.minX / rasterTileSize; tileX <= triangle.maxX / rasterTileSize; ++tileX) {
+                RasterizeTriangleInTile(
+                    triangle, tileX * rasterTileSize, tileY * rasterTileSize,
+                    [&](unsigned int X, unsigned int Y, float lambda0, float lambda1, float lambda2) {
+                        AddTexelCandidate(builder, static_cast<size_t>(Y) * width + X,
+                                          InterpolateDepth(triangle, lambda0, lambda1, lambda2),
+                                          InterpolateTextureCoord(triangle, lambda0, lambda1, lambda2), layer);
+                    });
+            }
+        }
+    }
+    return FinishTexelMap(builder);
+}
+
+// Applies the model_fragment_shader.glsl rules to one reference, returns false when the fragment would be discarded.
+inline bool ResolveTexel(const ImageData &skin, const TexelReference &reference, unsigned char *pixel) {
+    unsigned int texelX = (static_cast<unsigned int>(reference.u) * skin.width) >> 16;
+    unsigned int texelY = (static_cast<unsigned int>(reference.v) * skin.height) >> 16;
+    const unsigned char *texel = &skin.data[(static_cast<size_t>(texelY) * skin.width + texelX) * 4];
+    if (reference.layer == TexelLayerBase) {
+        if (texel[3] == 255) {
+            std::memcpy(pixel, texel, 4);
+        } else {
+            pixel[0] = pixel[1] = pixel[2] = 0;
+            pixel[3] = 255;
+        }
+        return true;
+    }
+    if (texel[3] != 255) return false;
+    if (skin.upscaleRGBA && texel[0] == 0 && texel[1] == 0 && texel[2] == 0) return false;
+    std::memcpy(pixel, texel, 4);
+    return true;
+}
+
+inline void ResolveFallbacks(const TexelMap &map, const ImageData &skin, size_t pixelId, unsigned char *pixel) {
+    for (unsigned int index = map.fallbackStart[pixelId]; index < map.fallbackStart[pixelId + 1]; ++index) {
+        if (ResolveTexel(skin, map.fallbacks[index], pixel)) return;
+    }
+    std::memset(pixel, 0, 4);
+}
+
+// Renders a skin through the map into a bottom-up RGBA model layer, transparent where no fragment survives.
+ImageData ApplyTexelMap(const TexelMap &map, const ImageData &skin) {
+    ImageData layer;
+    layer.width = map.width;
+    layer.height = map.height;
+    layer.bytePerPixel = 4;
+    layer.upscaleRGBA = false;
+    size_t pixelCount = static_cast<size_t>(map.width) * map.height;
+    layer.data = new unsigned char[pixelCount * 4];
+    size_t pixelId = 0;
+#ifdef __AVX2__
+    // eight pixels at a time: gather the references (u | v << 16 at byte 0, layer at byte 4), then the texels; only
+    // pixels whose attachment texel is discarded leave the vector path
+    const int *referenceBase = reinterpret_cast<const int *>(map.primary.data());
+    const int *texelBase = reinterpret_cast<const int *>(skin.data);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i skinWidth = _mm256_set1_epi32(skin.width), skinHeight = _mm256_set1_epi32(skin.height);
+    const __m256i lowMask = _mm256_set1_epi32(0xFFFF), byteMask = _mm256_set1_epi32(0xFF);
+    const __m256i colorMask = _mm256_set1_epi32(0x00FFFFFF);
+    const __m256i opaqueBlack = _mm256_set1_epi32(static_cast<int>(0xFF000000u));
+    const __m256i baseLayer = _mm256_set1_epi32(TexelLayerBase);
+    const __m256i attachmentLayer = _mm256_set1_epi32(TexelLayerAttachment);
+    for (; pixelId + 8 <= pixelCount; pixelId += 8) {
+        // offsets in 2 byte units, sizeof(TexelReference) == 6
+        __m256i offset = _mm256_mullo_epi32(_mm256_add_epi32(_mm256_set1_epi32(static_cast<int>(pixelId)), lanes),
+                                            _mm256_set1_epi32(3));
+        __m256i coords = _mm256_i32gather_epi32(referenceBase, offset, 2);
+        __m256i layers = _mm256_i32gather_epi32(referenceBase, _mm256_add_epi32(offset, _mm256_set1_epi32(1)), 2);
+        layers = _mm256_and_si256(_mm256_srli_epi32(layers, 16), byteMask);
+        __m256i texelX = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_and_si256(coords, lowMask), skinWidth), 16);
+        __m256i texelY = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_srli_epi32(coords, 16), skinHeight), 16);
+        __m256i texels =
+            _mm256_i32gather_epi32(texelBase, _mm256_add_epi32(_mm256_mullo_epi32(texelY, skinWidth), texelX), 4);
+
+        __m256i opaque = _mm256_cmpeq_epi32(_mm256_srli_epi32(texels, 24), byteMask);
+        __m256i isBase = _mm256_cmpeq_epi32(layers, baseLayer);
+        __m256i isAttachment = _mm256_cmpeq_epi32(layers, attachmentLayer);
+        __m256i visible = _mm256_and_si256(isAttachment, opaque);
+        if (skin.upscaleRGBA) {
+            __m256i black = _mm256_cmpeq_epi32(_mm256_and_si256(texels, colorMask), _mm256_setzero_si256());
+            visible = _mm256_andnot_si256(black, visible);
+        }
+        __m256i result = _mm256_and_si256(isBase, _mm256_blendv_epi8(opaqueBlack, texels, opaque));
+        result = _mm256_or_si256(result, _mm256_and_si256(visible, texels));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(&layer.data[pixelId * 4]), result);
+
+        int unresolved = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_andnot_si256(visible, isAttachment)));
+        for (int lane = 0; unresolved != 0; ++lane, unresolved >>= 1) {
+            if (unresolved & 1) ResolveFallbacks(map, skin, pixelId + lane, &layer.data[(pixelId + lane) * 4]);
+        }
+    }
+#endif
+    for (; pixelId < pixelCount; ++pixelId) {
+        unsigned char *pixel = &layer.data[pixelId * 4];
+        const TexelReference &reference = map.primary[pixelId];
+        if (reference.layer == TexelLayerNone) {
+            std::memset(pixel, 0, 4);
+        } else if (!ResolveTexel(skin, reference, pixel)) {
+            ResolveFallbacks(map, skin, pixelId, pixel);
+        }
+    }
+    return layer;
+}
+
+// 'TXMP' magic, version, width, height, fallback count, then the raw arrays.
+void WriteTexelMap(const TexelMap &map, const std::string &filename) {
+    std::FILE *outputPtr = std::fopen(filename.c_str(), "wb");
+    if (outputPtr == nullptr) {
+        std::cerr << "ERROR: Unable to open texel map file \'" << filename << "\'" << std::endl;
+        exit(-1);
+    }
+    unsigned int header[4] = {1, map.width, map.height, static_cast<unsigned int>(map.fallbacks.size())};
+    std::fwrite("TXMP", 1, 4, outputPtr);
+    std::fwrite(header, sizeof(header), 1, outputPtr);
+    std::fwrite(map.primary.data(), sizeof(TexelReference), map.primary.size(), outputPtr);
+    std::fwrite(map.fallbackStart.data(), sizeof(unsigned int), map.fallbackStart.size(), outputPtr);
+    std::fwrite(map.fallbacks.data(), sizeof(TexelReference), map.fallbacks.size(), outputPtr);
+    std::fclose(outputPtr);
+}
+
+inline bool IsValidTexelReference(const TexelReference &reference, bool allowNone) {
+    // u and v are fractions of the skin size, so any value lands inside the skin; only the layer can be out of range
+    return reference.layer == TexelLayerBase || reference.layer == TexelLayerAttachment ||
+           (allowNone && reference.layer == TexelLayerNone);
+}
+
+// Rejects files that do not match the frame or whose offsets and references would index outside the arrays or skin.
+bool ReadTexelMap(const std::string &filename, unsigned int width, unsigned int height, TexelMap &map) {
+    std::FILE *inputPtr = std::fopen(filename.c_str(), "rb");
+    if (inputPtr == nullptr) return false;
+    char magic[4];
+    unsigned int header[4];
+    bool valid = std::fread(magic, 1, 4, inputPtr) == 4 && std::memcmp(magic, "TXMP", 4) == 0 &&
+                 std::fread(header, sizeof(header), 1, inputPtr) == 1 && header[0] == 1 && header[1] == width &&
+                 header[2] == height;
+    size_t pixelCount = static_cast<size_t>(width) * height;
+    if (valid) {
+        // the arrays must exactly fill the rest of the file, checked before anything is allocated
+        long dataStart = std::ftell(inputPtr);
+        valid = dataStart >= 0 && std::fseek(inputPtr, 0, SEEK_END) == 0;
+        long fileSize = valid ? std::ftell(inputPtr) : -1;
+        size_t expectedSize =
+            (pixelCount + header[3]) * sizeof(TexelReference) + (pixelCount + 1) * sizeof(unsigned int);
+        valid = valid && fileSize >= dataStart && static_cast<size_t>(fileSize - dataStart) == expectedSize &&
+                std::fseek(inputPtr, dataStart, SEEK_SET) == 0;
+    }
+    if (valid) {
+        map.width = width;
+        map.height = height;
+        map.primary.resize(pixelCount);
+        map.fallbackStart.resize(pixelCount + 1);
+        map.fallbacks.resize(header[3]);
+        valid = std::fread(map.primary.data(), sizeof(TexelReference), pixelCount, inputPtr) == pixelCount &&
+                std::fread(map.fallbackStart.data(), sizeof(unsigned int), pixelCount + 1, inputPtr) ==
+                    pixelCount + 1 &&
+                std::fread(map.fallbacks.data(), sizeof(TexelReference), header[3], inputPtr) == header[3];
+    }
+    std::fclose(inputPtr);
+    if (!valid) return false;
+    if (map.fallbackStart[0] != 0 || map.fallbackStart[pixelCount] != header[3]) return false;
+    for (size_t pixelId = 0; pixelId < pixelCount; ++pixelId) {
+        if (map.fallbackStart[pixelId] > map.fallbackStart[pixelId + 1]) return false;
+        if (!IsValidTexelReference(map.primary[pixelId], true)) return false;
+    }
+    for (const TexelReference &reference : map.fallbacks) {
+        if (!IsValidTexelReference(reference, false)) return false;
+    }
+    return true;
+}
+
+// Maps are cached per (camera, frame size, model) in memory and, with texelMapCache=, on disk.
+std::string GetTexelMapCacheKey(const std::string &kind) {
+    unsigned long long hash = HashFileContent(Global::modelPath);
+    hash = HashFileContent(Global::modelConfigPath, hash);
+    hash = HashString(kind, hash);
+    hash = HashValue(Global::frameWidth, hash);
+    hash = HashValue(Global::frameHeight, hash);
+    hash = HashValue(Global::thinArm ? 1 : 0, hash);  // selects the embedded model when model= is not given
+    hash = HashString(Global::cameras, hash);
+    hash = HashFileContent(Global::pose, hash);
+    hash = HashString(std::to_string(Global::poseTime), hash);
+    std::ostringstream key;
+    key << kind << '-' << std::hex << std::setw(16) << std::setfill('0') << hash;
+    return key.str();
+}
+
+const TexelMap &GetTexelMap(const std::string &kind, const std::function<TexelMap()> &build) {
+    static std::map<std::string, TexelMap> cache;
+    std::string key = GetTexelMapCacheKey(kind);
+    auto iterator = cache.find(key);
+    if (iterator != cache.end()) return iterator->second;
+    TexelMap map;
+    std::string cacheFile = Global::texelMapCachePath.empty() ? "" : Global::texelMapCachePath + '/' + key + ".txmp";
+    if (!cacheFile.empty() && ReadTexelMap(cacheFile, static_cast<unsigned int>(Global::frameWidth),
+                                           static_cast<unsigned int>(Global::frameHeight), map)) {
+        std::cout << "INFO: texel map cache hit \'" << cacheFile << '\'' << std::endl;
+    } else {
+        map = build();
+        std::cout << "INFO: built texel map with " << map.fallbacks.size() << " fallback texels" << std::endl;
+        if (!cacheFile.empty()) WriteTexelMap(map, cacheFile);
+    }
+    return cache[key] = map;
+}